@@ -0,0 +1 @@
+mkdisk.o: mkdisk.c
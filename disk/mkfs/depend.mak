@@ -0,0 +1,3 @@
+mkfs.o: mkfs.c blkdev.h gpt.h
+gpt.o: gpt.c blkdev.h gpt.h
+blkdev.o: blkdev.c blkdev.h
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <uuid/uuid.h>
 
+#include "blkdev.h"
 #include "gpt.h"
 
 
@@ -152,21 +153,19 @@ static void uuid_copyLE(unsigned char *dst, unsigned char *src) {
 /**************************************************************/
 
 
-static void rdSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fread(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+static void rdSector(BlkDev *disk, unsigned int sectorNum,
+                     unsigned char *buf) {
+  if (blkReadAt(disk, (off_t) sectorNum * SECTOR_SIZE,
+                buf, SECTOR_SIZE) < 0) {
     error("cannot read sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
 
 
-static void wrSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fwrite(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+static void wrSector(BlkDev *disk, unsigned int sectorNum,
+                     unsigned char *buf) {
+  if (blkWriteAt(disk, (off_t) sectorNum * SECTOR_SIZE,
+                 buf, SECTOR_SIZE) < 0) {
     error("cannot write sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
@@ -182,7 +181,7 @@ static unsigned char backupTblHdr[SECTOR_SIZE];
 static unsigned char backupTable[NUMBER_PART_BYTES];
 
 
-static void checkProtMBR(FILE *disk) {
+static void checkProtMBR(BlkDev *disk) {
   unsigned char protMBR[SECTOR_SIZE];
   int i;
 
@@ -202,7 +201,7 @@ static void checkProtMBR(FILE *disk) {
 }
 
 
-void gptRead(FILE *disk, unsigned int diskSize) {
+void gptRead(BlkDev *disk, unsigned int diskSize) {
   char signature[9];
   unsigned int oldHdrCRC;
   unsigned int newHdrCRC;
@@ -283,7 +282,7 @@ void gptRead(FILE *disk, unsigned int diskSize) {
 }
 
 
-void gptWrite(FILE *disk) {
+void gptWrite(BlkDev *disk) {
   unsigned int crc;
   int s;
   unsigned int backupLBAlo;
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <time.h>
 
+#include "blkdev.h"
 #include "gpt.h"
 
 
@@ -149,7 +150,7 @@ typedef struct {
 
 
 time_t now;		/* timestamp used throughout the file system */
-FILE *disk;		/* the file which holds the disk image */
+BlkDev disk;		/* the file which holds the disk image */
 Filsys filsys;		/* the file system's super block */
 EOS32_ino_t lastIno;	/* last inode allocated */
 
@@ -455,12 +456,7 @@ unsigned int fsSize;		/* file system size in sectors */
 
 
 void rdfs(EOS32_daddr_t bno, unsigned char *bf, int blkType) {
-  int n;
-
-  fseek(disk, (unsigned long) fsStart * SSIZE +
-        (unsigned long) bno * BSIZE, SEEK_SET);
-  n = fread(bf, 1, BSIZE, disk);
-  if (n != BSIZE) {
+  if (blkRead(&disk, bno, bf) < 0) {
     printf("read error: %d\n", bno);
     exit(1);
   }
@@ -491,8 +487,6 @@ void rdfs(EOS32_daddr_t bno, unsigned char *bf, int blkType) {
 
 
 void wtfs(EOS32_daddr_t bno, unsigned char *bf, int blkType) {
-  int n;
-
   switch (blkType) {
     case TYPE_COPY:
       /* nothing to do here */
@@ -516,10 +510,7 @@ void wtfs(EOS32_daddr_t bno, unsigned char *bf, int blkType) {
       error("illegal block type %d in wtfs()", blkType);
       break;
   }
-  fseek(disk, (unsigned long) fsStart * SSIZE +
-        (unsigned long) bno * BSIZE, SEEK_SET);
-  n = fwrite(bf, 1, BSIZE, disk);
-  if(n != BSIZE) {
+  if (blkWrite(&disk, bno, bf) < 0) {
     printf("write error: %d\n", bno);
     exit(1);
   }
@@ -1027,12 +1018,10 @@ int main(int argc, char *argv[]) {
   }
   time(&now);
   diskName = argv[1];
-  disk = fopen(diskName, "r+b");
-  if (disk == NULL) {
+  if (blkOpen(&disk, diskName, 1) < 0) {
     error("cannot open disk image '%s'", diskName);
   }
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk) / SSIZE;
+  diskSize = disk.size / SSIZE;
   /* set fsStart and fsSize */
   if (strcmp(argv[2], "*") == 0) {
     /* whole disk contains one single file system */
@@ -1044,7 +1033,7 @@ int main(int argc, char *argv[]) {
     if (*endptr != '\0') {
       error("cannot read partition number '%s'", argv[2]);
     }
-    gptRead(disk, diskSize);
+    gptRead(&disk, diskSize);
     gptGetEntry(partNumber, &entry);
     if (strcmp(entry.type, GPT_NULL_UUID) == 0) {
       error("partition %d is not used", partNumber);
@@ -1056,6 +1045,7 @@ int main(int argc, char *argv[]) {
     fsStart = entry.start;
     fsSize = entry.end - entry.start + 1;
   }
+  blkSetStart(&disk, fsStart);
   printf("File system space is %u (0x%X) sectors of %d bytes each.\n",
          fsSize, fsSize, SSIZE);
   if (fsSize % SPB != 0) {
@@ -1158,5 +1148,6 @@ int main(int argc, char *argv[]) {
   fillFreeInodeList(numInodes);
   /* finally write super block and return */
   wtfs(1, (unsigned char *) &filsys, TYPE_SUPER);
+  blkClose(&disk);
   return 0;
 }
@@ -0,0 +1 @@
+mkgpt.o: mkgpt.c
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 
@@ -143,11 +145,9 @@ void uuid_copyLE(unsigned char *dst, unsigned char *src) {
 /**************************************************************/
 
 
-void wrSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fwrite(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void wrSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pwrite(disk, buf, SECTOR_SIZE,
+             (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot write sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
@@ -347,7 +347,7 @@ int main(int argc, char *argv[]) {
   char *diskName;
   char *bootName;
   char *mngrName;
-  FILE *disk;
+  int disk;
   unsigned long diskSize;
   unsigned int numSectors;
   unsigned char protMBR[SECTOR_SIZE];
@@ -377,13 +377,12 @@ int main(int argc, char *argv[]) {
   /* initialize CRC32 table */
   crc32Init();
   /* open disk image */
-  disk = fopen(diskName, "r+b");
-  if (disk == NULL) {
+  disk = open(diskName, O_RDWR);
+  if (disk < 0) {
     error("cannot open disk image '%s'", diskName);
   }
   /* determine disk size */
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk);
+  diskSize = lseek(disk, 0, SEEK_END);
   numSectors = diskSize / SECTOR_SIZE;
   printf("Disk '%s' has %u (0x%X) sectors.\n",
          diskName, numSectors, numSectors);
@@ -426,6 +425,6 @@ int main(int argc, char *argv[]) {
   makeBackupTblHdr(backupTblHdr, partTblHdr, numSectors);
   wrSector(disk, numSectors - 1, backupTblHdr);
   /* close disk image and exit */
-  fclose(disk);
+  close(disk);
   return 0;
 }
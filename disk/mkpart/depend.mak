@@ -0,0 +1 @@
+mkpart.o: mkpart.c parttypes.h
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 #include "parttypes.h"
@@ -147,21 +149,17 @@ void uuid_copyLE(unsigned char *dst, unsigned char *src) {
 /**************************************************************/
 
 
-void rdSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fread(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void rdSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pread(disk, buf, SECTOR_SIZE,
+            (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot read sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
 
 
-void wrSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fwrite(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void wrSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pwrite(disk, buf, SECTOR_SIZE,
+             (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot write sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
@@ -177,7 +175,7 @@ unsigned char backupTblHdr[SECTOR_SIZE];
 unsigned char backupTable[NUMBER_PART_BYTES];
 
 
-void checkProtMBR(FILE *disk) {
+void checkProtMBR(int disk) {
   unsigned char protMBR[SECTOR_SIZE];
   int i;
 
@@ -197,7 +195,7 @@ void checkProtMBR(FILE *disk) {
 }
 
 
-void checkValidGPT(FILE *disk, unsigned int numSectors) {
+void checkValidGPT(int disk, unsigned int numSectors) {
   char signature[9];
   unsigned int oldHdrCRC;
   unsigned int newHdrCRC;
@@ -278,7 +276,7 @@ void checkValidGPT(FILE *disk, unsigned int numSectors) {
 }
 
 
-void writeValidGPT(FILE *disk) {
+void writeValidGPT(int disk) {
   unsigned int crc;
   int s;
   unsigned int backupLBAlo;
@@ -465,7 +463,7 @@ bool checkGap(unsigned int addr, unsigned int size) {
 /**************************************************************/
 
 
-void mkPartition(FILE *disk,
+void mkPartition(int disk,
                  int partNumber,
                  char *partCode,
                  unsigned int partStart,
@@ -562,7 +560,7 @@ int main(int argc, char *argv[]) {
   int partNumber;
   unsigned int partStart;
   char *endptr;
-  FILE *disk;
+  int disk;
   unsigned long diskSize;
   unsigned int numSectors;
   unsigned int firstSector;
@@ -623,13 +621,12 @@ int main(int argc, char *argv[]) {
   /* initialize CRC32 table */
   crc32Init();
   /* open disk image */
-  disk = fopen(diskName, "r+b");
-  if (disk == NULL) {
+  disk = open(diskName, O_RDWR);
+  if (disk < 0) {
     error("cannot open disk image '%s'", diskName);
   }
   /* determine disk size */
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk);
+  diskSize = lseek(disk, 0, SEEK_END);
   numSectors = diskSize / SECTOR_SIZE;
   printf("Disk '%s' has %u (0x%X) sectors.\n",
          diskName, numSectors, numSectors);
@@ -0,0 +1 @@
+rmpart.o: rmpart.c
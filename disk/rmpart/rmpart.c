@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 
@@ -124,21 +126,17 @@ bool isZero(unsigned char *buf, int len) {
 /**************************************************************/
 
 
-void rdSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fread(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void rdSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pread(disk, buf, SECTOR_SIZE,
+            (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot read sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
 
 
-void wrSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fwrite(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void wrSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pwrite(disk, buf, SECTOR_SIZE,
+             (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot write sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
@@ -154,7 +152,7 @@ unsigned char backupTblHdr[SECTOR_SIZE];
 unsigned char backupTable[NUMBER_PART_BYTES];
 
 
-void checkProtMBR(FILE *disk) {
+void checkProtMBR(int disk) {
   unsigned char protMBR[SECTOR_SIZE];
   int i;
 
@@ -174,7 +172,7 @@ void checkProtMBR(FILE *disk) {
 }
 
 
-void checkValidGPT(FILE *disk, unsigned int numSectors) {
+void checkValidGPT(int disk, unsigned int numSectors) {
   char signature[9];
   unsigned int oldHdrCRC;
   unsigned int newHdrCRC;
@@ -255,7 +253,7 @@ void checkValidGPT(FILE *disk, unsigned int numSectors) {
 }
 
 
-void writeValidGPT(FILE *disk) {
+void writeValidGPT(int disk) {
   unsigned int crc;
   int s;
   unsigned int backupLBAlo;
@@ -293,7 +291,7 @@ void writeValidGPT(FILE *disk) {
 /**************************************************************/
 
 
-void rmPartition(FILE *disk, int partNumber) {
+void rmPartition(int disk, int partNumber) {
   unsigned char *p;
 
   /* compute pointer to partition entry */
@@ -314,7 +312,7 @@ int main(int argc, char *argv[]) {
   char *diskName;
   int partNumber;
   char *endptr;
-  FILE *disk;
+  int disk;
   unsigned long diskSize;
   unsigned int numSectors;
 
@@ -336,13 +334,12 @@ int main(int argc, char *argv[]) {
   /* initialize CRC32 table */
   crc32Init();
   /* open disk image */
-  disk = fopen(diskName, "r+b");
-  if (disk == NULL) {
+  disk = open(diskName, O_RDWR);
+  if (disk < 0) {
     error("cannot open disk image '%s'", diskName);
   }
   /* determine disk size */
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk);
+  diskSize = lseek(disk, 0, SEEK_END);
   numSectors = diskSize / SECTOR_SIZE;
   printf("Disk '%s' has %u (0x%X) sectors.\n",
          diskName, numSectors, numSectors);
@@ -0,0 +1,183 @@
+/*
+ * blkdev.c -- positional block I/O on a disk image
+ */
+
+/*
+ * All transfers name their disk position explicitly, so there
+ * is no shared file position and several threads may issue
+ * I/O on the same device at once. Every function returns 0 on
+ * success and a negative error number on failure.
+ */
+
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "blkdev.h"
+
+
+#define MAX_IOV		64	/* iovecs handled in one call */
+
+
+/**************************************************************/
+
+
+int blkOpen(BlkDev *dev, char *name, int writable) {
+  struct stat st;
+
+  dev->fd = open(name, writable ? O_RDWR : O_RDONLY);
+  if (dev->fd < 0) {
+    return -errno;
+  }
+  if (fstat(dev->fd, &st) < 0) {
+    close(dev->fd);
+    return -errno;
+  }
+  dev->size = st.st_size;
+  dev->start = 0;
+  return 0;
+}
+
+
+void blkClose(BlkDev *dev) {
+  close(dev->fd);
+  dev->fd = -1;
+}
+
+
+void blkSetStart(BlkDev *dev, unsigned int startSector) {
+  dev->start = (off_t) startSector * BLKDEV_SECTOR_SIZE;
+}
+
+
+off_t blkOffset(BlkDev *dev, unsigned int blockNum) {
+  return dev->start + (off_t) blockNum * BLKDEV_BLOCK_SIZE;
+}
+
+
+/**************************************************************/
+
+
+int blkReadAt(BlkDev *dev, off_t pos, void *buf, size_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = pread(dev->fd, buf, size, pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      /* beyond end of disk image */
+      return -EIO;
+    }
+    buf = (char *) buf + n;
+    size -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+
+int blkWriteAt(BlkDev *dev, off_t pos, void *buf, size_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = pwrite(dev->fd, buf, size, pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    buf = (char *) buf + n;
+    size -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+
+/**************************************************************/
+
+
+int blkRead(BlkDev *dev, unsigned int blockNum, void *buf) {
+  return blkReadAt(dev, blkOffset(dev, blockNum), buf, BLKDEV_BLOCK_SIZE);
+}
+
+
+int blkWrite(BlkDev *dev, unsigned int blockNum, void *buf) {
+  return blkWriteAt(dev, blkOffset(dev, blockNum), buf, BLKDEV_BLOCK_SIZE);
+}
+
+
+/*
+ * Transfer a run of consecutive disk blocks starting at blockNum
+ * to or from the buffers described by iov, with as few system
+ * calls as possible. Partial transfers are continued where they
+ * stopped.
+ */
+static int blkXferv(BlkDev *dev, unsigned int blockNum,
+                    struct iovec *iov, int iovcnt, int write) {
+  struct iovec vec[MAX_IOV];
+  off_t pos;
+  int cnt;
+  int i;
+  ssize_t n;
+
+  pos = blkOffset(dev, blockNum);
+  while (iovcnt > 0) {
+    cnt = iovcnt < MAX_IOV ? iovcnt : MAX_IOV;
+    for (i = 0; i < cnt; i++) {
+      vec[i] = iov[i];
+    }
+    i = 0;
+    while (i < cnt) {
+      if (write) {
+        n = pwritev(dev->fd, vec + i, cnt - i, pos);
+      } else {
+        n = preadv(dev->fd, vec + i, cnt - i, pos);
+      }
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -errno;
+      }
+      if (n == 0) {
+        return -EIO;
+      }
+      pos += n;
+      while (i < cnt && n >= (ssize_t) vec[i].iov_len) {
+        n -= vec[i].iov_len;
+        i++;
+      }
+      if (i < cnt) {
+        vec[i].iov_base = (char *) vec[i].iov_base + n;
+        vec[i].iov_len -= n;
+      }
+    }
+    iov += cnt;
+    iovcnt -= cnt;
+  }
+  return 0;
+}
+
+
+int blkReadv(BlkDev *dev, unsigned int blockNum,
+             struct iovec *iov, int iovcnt) {
+  return blkXferv(dev, blockNum, iov, iovcnt, 0);
+}
+
+
+int blkWritev(BlkDev *dev, unsigned int blockNum,
+              struct iovec *iov, int iovcnt) {
+  return blkXferv(dev, blockNum, iov, iovcnt, 1);
+}
@@ -0,0 +1,40 @@
+/*
+ * blkdev.h -- positional block I/O on a disk image
+ */
+
+
+#ifndef _BLKDEV_H_
+#define _BLKDEV_H_
+
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+#define BLKDEV_SECTOR_SIZE	512
+#define BLKDEV_BLOCK_SIZE	4096
+
+
+typedef struct {
+  int fd;		/* file descriptor of the disk image */
+  off_t size;		/* size of the disk image in bytes */
+  off_t start;		/* byte offset of block 0 of the file system */
+} BlkDev;
+
+
+int blkOpen(BlkDev *dev, char *name, int writable);
+void blkClose(BlkDev *dev);
+void blkSetStart(BlkDev *dev, unsigned int startSector);
+off_t blkOffset(BlkDev *dev, unsigned int blockNum);
+
+int blkReadAt(BlkDev *dev, off_t pos, void *buf, size_t size);
+int blkWriteAt(BlkDev *dev, off_t pos, void *buf, size_t size);
+
+int blkRead(BlkDev *dev, unsigned int blockNum, void *buf);
+int blkWrite(BlkDev *dev, unsigned int blockNum, void *buf);
+int blkReadv(BlkDev *dev, unsigned int blockNum,
+             struct iovec *iov, int iovcnt);
+int blkWritev(BlkDev *dev, unsigned int blockNum,
+              struct iovec *iov, int iovcnt);
+
+#endif /* _BLKDEV_H_ */
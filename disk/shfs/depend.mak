@@ -0,0 +1,3 @@
+shfs.o: shfs.c blkdev.h gpt.h
+gpt.o: gpt.c blkdev.h gpt.h
+blkdev.o: blkdev.c blkdev.h
@@ -23,8 +23,8 @@ typedef struct {
 } GptEntry;
 
 
-void gptRead(FILE *disk, unsigned int diskSize);
-void gptWrite(FILE *disk);
+void gptRead(BlkDev *disk, unsigned int diskSize);
+void gptWrite(BlkDev *disk);
 
 void gptGetEntry(int partNumber, GptEntry *entry);
 void gptSetEntry(int partNumber, GptEntry *entry);
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <time.h>
 
+#include "blkdev.h"
 #include "gpt.h"
 
 
@@ -66,12 +67,10 @@ unsigned int fsStart;		/* file system start sector */
 unsigned int fsSize;		/* file system size in sectors */
 
 
-void readBlock(FILE *disk,
+void readBlock(BlkDev *disk,
                EOS32_daddr_t blockNum,
                unsigned char *blockBuffer) {
-  fseek(disk, (unsigned long) fsStart * SECTOR_SIZE +
-        (unsigned long) blockNum * BLOCK_SIZE, SEEK_SET);
-  if (fread(blockBuffer, BLOCK_SIZE, 1, disk) != 1) {
+  if (blkRead(disk, blockNum, blockBuffer) < 0) {
     error("cannot read block %lu (0x%lX)", blockNum, blockNum);
   }
 }
@@ -514,7 +513,7 @@ int parseNumber(char **pc, unsigned int *pi) {
 
 int main(int argc, char *argv[]) {
   char *diskName;
-  FILE *disk;
+  BlkDev disk;
   unsigned int diskSize;
   int partNumber;
   char *endptr;
@@ -537,12 +536,10 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
   diskName = argv[1];
-  disk = fopen(diskName, "rb");
-  if (disk == NULL) {
+  if (blkOpen(&disk, diskName, 0) < 0) {
     error("cannot open disk image '%s'", diskName);
   }
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk) / SECTOR_SIZE;
+  diskSize = disk.size / SECTOR_SIZE;
   /* set fsStart and fsSize */
   if (strcmp(argv[2], "*") == 0) {
     /* whole disk contains one single file system */
@@ -554,7 +551,7 @@ int main(int argc, char *argv[]) {
     if (*endptr != '\0') {
       error("cannot read partition number '%s'", argv[2]);
     }
-    gptRead(disk, diskSize);
+    gptRead(&disk, diskSize);
     gptGetEntry(partNumber, &entry);
     if (strcmp(entry.type, GPT_NULL_UUID) == 0) {
       error("partition %d is not used", partNumber);
@@ -566,6 +563,7 @@ int main(int argc, char *argv[]) {
     fsStart = entry.start;
     fsSize = entry.end - entry.start + 1;
   }
+  blkSetStart(&disk, fsStart);
   printf("File system space is %u (0x%X) sectors of %d bytes each.\n",
          fsSize, fsSize, SECTOR_SIZE);
   if (fsSize % SPB != 0) {
@@ -578,7 +576,7 @@ int main(int argc, char *argv[]) {
     error("file system has less than 2 blocks");
   }
   currBlock = 1;
-  readBlock(disk, currBlock, blockBuffer);
+  readBlock(&disk, currBlock, blockBuffer);
   help();
   quit = 0;
   while (!quit) {
@@ -631,7 +629,7 @@ int main(int argc, char *argv[]) {
           break;
         }
         currBlock = n;
-        readBlock(disk, currBlock, blockBuffer);
+        readBlock(&disk, currBlock, blockBuffer);
         break;
       case '+':
         n = currBlock + 1;
@@ -640,7 +638,7 @@ int main(int argc, char *argv[]) {
           break;
         }
         currBlock = n;
-        readBlock(disk, currBlock, blockBuffer);
+        readBlock(&disk, currBlock, blockBuffer);
         break;
       case '-':
         n = currBlock - 1;
@@ -649,7 +647,7 @@ int main(int argc, char *argv[]) {
           break;
         }
         currBlock = n;
-        readBlock(disk, currBlock, blockBuffer);
+        readBlock(&disk, currBlock, blockBuffer);
         break;
       case 't':
         p = line + 1;
@@ -668,6 +666,6 @@ int main(int argc, char *argv[]) {
         break;
     }
   }
-  fclose(disk);
+  blkClose(&disk);
   return 0;
 }
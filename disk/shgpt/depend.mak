@@ -0,0 +1 @@
+shgpt.o: shgpt.c
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 
@@ -147,11 +149,9 @@ void uuid_copyLE(unsigned char *dst, unsigned char *src) {
 /**************************************************************/
 
 
-void rdSector(FILE *disk, unsigned int sectorNum, unsigned char *buf) {
-  if (fseek(disk, (unsigned long) sectorNum * SECTOR_SIZE, SEEK_SET) < 0) {
-    error("cannot position to sector %u (0x%X)", sectorNum, sectorNum);
-  }
-  if (fread(buf, 1, SECTOR_SIZE, disk) != SECTOR_SIZE) {
+void rdSector(int disk, unsigned int sectorNum, unsigned char *buf) {
+  if (pread(disk, buf, SECTOR_SIZE,
+            (off_t) sectorNum * SECTOR_SIZE) != SECTOR_SIZE) {
     error("cannot read sector %u (0x%X)", sectorNum, sectorNum);
   }
 }
@@ -479,7 +479,7 @@ void showPartTable(unsigned char *buf) {
 
 int main(int argc, char *argv[]) {
   char *diskName;
-  FILE *disk;
+  int disk;
   unsigned long diskSize;
   unsigned int numSectors;
   unsigned char protMBR[SECTOR_SIZE];
@@ -502,13 +502,12 @@ int main(int argc, char *argv[]) {
   /* initialize CRC32 table */
   crc32Init();
   /* open disk image */
-  disk = fopen(diskName, "rb");
-  if (disk == NULL) {
+  disk = open(diskName, O_RDONLY);
+  if (disk < 0) {
     error("cannot open disk image '%s'", diskName);
   }
   /* determine disk size */
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk);
+  diskSize = lseek(disk, 0, SEEK_END);
   numSectors = diskSize / SECTOR_SIZE;
   printf("Disk '%s' has %u (0x%X) sectors.\n",
          diskName, numSectors, numSectors);
@@ -0,0 +1,513 @@
+/*
+ * blkdev.c -- positional block I/O on a disk image
+ */
+
+/*
+ * All transfers name their disk position explicitly, so there
+ * is no shared file position and several threads may issue
+ * I/O on the same device at once. Every function returns 0 on
+ * success and a negative error number on failure.
+ *
+ * If compiled with BLKDEV_URING, batches of independent block
+ * reads are submitted through an io_uring owned by the calling
+ * thread, so that many reads are in flight at the same time.
+ * Without it, or if the kernel refuses to set up a ring, the
+ * batch is read block by block.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef BLKDEV_URING
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "blkdev.h"
+
+
+#define MAX_IOV		64	/* iovecs handled in one call */
+#define URING_DEPTH	64	/* submission queue entries per ring */
+
+
+/**************************************************************/
+
+
+int blkOpen(BlkDev *dev, char *name, int writable) {
+  struct stat st;
+
+  dev->fd = open(name, writable ? O_RDWR : O_RDONLY);
+  if (dev->fd < 0) {
+    return -errno;
+  }
+  if (fstat(dev->fd, &st) < 0) {
+    close(dev->fd);
+    return -errno;
+  }
+  dev->size = st.st_size;
+  dev->start = 0;
+  return 0;
+}
+
+
+void blkClose(BlkDev *dev) {
+  close(dev->fd);
+  dev->fd = -1;
+}
+
+
+void blkSetStart(BlkDev *dev, unsigned int startSector) {
+  dev->start = (off_t) startSector * BLKDEV_SECTOR_SIZE;
+}
+
+
+off_t blkOffset(BlkDev *dev, unsigned int blockNum) {
+  return dev->start + (off_t) blockNum * BLKDEV_BLOCK_SIZE;
+}
+
+
+/**************************************************************/
+
+
+int blkReadAt(BlkDev *dev, off_t pos, void *buf, size_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = pread(dev->fd, buf, size, pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      /* beyond end of disk image */
+      return -EIO;
+    }
+    buf = (char *) buf + n;
+    size -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+
+int blkWriteAt(BlkDev *dev, off_t pos, void *buf, size_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = pwrite(dev->fd, buf, size, pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    buf = (char *) buf + n;
+    size -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+
+/**************************************************************/
+
+
+int blkRead(BlkDev *dev, unsigned int blockNum, void *buf) {
+  return blkReadAt(dev, blkOffset(dev, blockNum), buf, BLKDEV_BLOCK_SIZE);
+}
+
+
+int blkWrite(BlkDev *dev, unsigned int blockNum, void *buf) {
+  return blkWriteAt(dev, blkOffset(dev, blockNum), buf, BLKDEV_BLOCK_SIZE);
+}
+
+
+/*
+ * Transfer a run of consecutive disk blocks starting at blockNum
+ * to or from the buffers described by iov, with as few system
+ * calls as possible. Partial transfers are continued where they
+ * stopped.
+ */
+static int blkXferv(BlkDev *dev, unsigned int blockNum,
+                    struct iovec *iov, int iovcnt, int write) {
+  struct iovec vec[MAX_IOV];
+  off_t pos;
+  int cnt;
+  int i;
+  ssize_t n;
+
+  pos = blkOffset(dev, blockNum);
+  while (iovcnt > 0) {
+    cnt = iovcnt < MAX_IOV ? iovcnt : MAX_IOV;
+    for (i = 0; i < cnt; i++) {
+      vec[i] = iov[i];
+    }
+    i = 0;
+    while (i < cnt) {
+      if (write) {
+        n = pwritev(dev->fd, vec + i, cnt - i, pos);
+      } else {
+        n = preadv(dev->fd, vec + i, cnt - i, pos);
+      }
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -errno;
+      }
+      if (n == 0) {
+        return -EIO;
+      }
+      pos += n;
+      while (i < cnt && n >= (ssize_t) vec[i].iov_len) {
+        n -= vec[i].iov_len;
+        i++;
+      }
+      if (i < cnt) {
+        vec[i].iov_base = (char *) vec[i].iov_base + n;
+        vec[i].iov_len -= n;
+      }
+    }
+    iov += cnt;
+    iovcnt -= cnt;
+  }
+  return 0;
+}
+
+
+int blkReadv(BlkDev *dev, unsigned int blockNum,
+             struct iovec *iov, int iovcnt) {
+  return blkXferv(dev, blockNum, iov, iovcnt, 0);
+}
+
+
+int blkWritev(BlkDev *dev, unsigned int blockNum,
+              struct iovec *iov, int iovcnt) {
+  return blkXferv(dev, blockNum, iov, iovcnt, 1);
+}
+
+
+/*
+ * Tell the kernel that a run of blocks will be read soon. The
+ * blocks are fetched into the page cache in the background.
+ */
+int blkAdvise(BlkDev *dev, unsigned int blockNum, unsigned int count) {
+  return -posix_fadvise(dev->fd, blkOffset(dev, blockNum),
+                        (off_t) count * BLKDEV_BLOCK_SIZE,
+                        POSIX_FADV_WILLNEED);
+}
+
+
+/*
+ * Wait until all data written so far has reached the disk.
+ */
+int blkSync(BlkDev *dev) {
+  if (fdatasync(dev->fd) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+
+/**************************************************************/
+
+/* batched reads */
+
+
+#ifdef BLKDEV_URING
+
+
+typedef struct {
+  int fd;				/* the ring's file descriptor */
+  unsigned int entries;			/* number of submission entries */
+  unsigned int *sqHead;			/* submission queue */
+  unsigned int *sqTail;
+  unsigned int *sqMask;
+  unsigned int *sqArray;
+  struct io_uring_sqe *sqes;
+  unsigned int *cqHead;			/* completion queue */
+  unsigned int *cqTail;
+  unsigned int *cqMask;
+  struct io_uring_cqe *cqes;
+  void *sqRing;				/* mappings to be released */
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+} Uring;
+
+
+static pthread_once_t uringOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t uringKey;
+
+
+static void uringDestroy(void *arg) {
+  Uring *u;
+
+  u = arg;
+  if (u == NULL || u == (Uring *) -1) {
+    return;
+  }
+  munmap(u->sqes, u->sqesSize);
+  if (u->cqRing != u->sqRing) {
+    munmap(u->cqRing, u->cqRingSize);
+  }
+  munmap(u->sqRing, u->sqRingSize);
+  close(u->fd);
+  free(u);
+}
+
+
+static void uringKeyCreate(void) {
+  pthread_key_create(&uringKey, uringDestroy);
+}
+
+
+static Uring *uringCreate(void) {
+  struct io_uring_params p;
+  Uring *u;
+  unsigned char *sq;
+  unsigned char *cq;
+
+  u = malloc(sizeof(Uring));
+  if (u == NULL) {
+    return NULL;
+  }
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+  if (u->fd < 0) {
+    free(u);
+    return NULL;
+  }
+  u->entries = p.sq_entries;
+  u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cqRingSize = p.cq_off.cqes +
+                  p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cqRingSize > u->sqRingSize) {
+      u->sqRingSize = u->cqRingSize;
+    }
+    u->cqRingSize = u->sqRingSize;
+  }
+  u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sqRing == MAP_FAILED) {
+    close(u->fd);
+    free(u);
+    return NULL;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cqRing = u->sqRing;
+  } else {
+    u->cqRing = mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cqRing == MAP_FAILED) {
+      munmap(u->sqRing, u->sqRingSize);
+      close(u->fd);
+      free(u);
+      return NULL;
+    }
+  }
+  u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    if (u->cqRing != u->sqRing) {
+      munmap(u->cqRing, u->cqRingSize);
+    }
+    munmap(u->sqRing, u->sqRingSize);
+    close(u->fd);
+    free(u);
+    return NULL;
+  }
+  sq = u->sqRing;
+  u->sqHead = (unsigned int *) (sq + p.sq_off.head);
+  u->sqTail = (unsigned int *) (sq + p.sq_off.tail);
+  u->sqMask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  u->sqArray = (unsigned int *) (sq + p.sq_off.array);
+  cq = u->cqRing;
+  u->cqHead = (unsigned int *) (cq + p.cq_off.head);
+  u->cqTail = (unsigned int *) (cq + p.cq_off.tail);
+  u->cqMask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return u;
+}
+
+
+/*
+ * Get the calling thread's ring, setting it up on first use.
+ * Returns NULL if io_uring is not available.
+ */
+static Uring *uringGet(void) {
+  Uring *u;
+
+  pthread_once(&uringOnce, uringKeyCreate);
+  u = pthread_getspecific(uringKey);
+  if (u == NULL) {
+    u = uringCreate();
+    pthread_setspecific(uringKey, u == NULL ? (Uring *) -1 : u);
+  }
+  return u == (Uring *) -1 ? NULL : u;
+}
+
+
+/*
+ * Take the completions which are there and finish their requests.
+ * Short reads are finished synchronously. Returns the number of
+ * requests finished.
+ */
+static int uringReap(Uring *u, BlkDev *dev, BlkReq *reqs) {
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+  int reaped;
+  BlkReq *r;
+
+  reaped = 0;
+  head = *u->cqHead;
+  while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+    cqe = &u->cqes[head & *u->cqMask];
+    r = &reqs[cqe->user_data];
+    if (cqe->res == BLKDEV_BLOCK_SIZE) {
+      r->res = 0;
+    } else
+    if (cqe->res >= 0) {
+      r->res = blkReadAt(dev, blkOffset(dev, r->blockNum) + cqe->res,
+                         (char *) r->buf + cqe->res,
+                         BLKDEV_BLOCK_SIZE - cqe->res);
+    } else {
+      /* e.g. a kernel without IORING_OP_READ */
+      r->res = blkRead(dev, r->blockNum, r->buf);
+    }
+    head++;
+    reaped++;
+  }
+  __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+
+
+/*
+ * Submit up to one ring's worth of reads and wait for all of
+ * them to complete. If the ring fails, the reads which the kernel
+ * has taken are waited for, the ring is given up, and the other
+ * reads are done synchronously; its error is returned then. In
+ * any case, every request has its result when this returns.
+ */
+static int uringReadBatch(Uring *u, BlkDev *dev,
+                          BlkReq *reqs, int numReqs) {
+  struct io_uring_sqe *sqe;
+  unsigned int first;
+  unsigned int tail;
+  unsigned int idx;
+  int submitted;
+  int completed;
+  int taken;
+  int ret;
+  int i;
+
+  first = *u->sqTail;
+  tail = first;
+  for (i = 0; i < numReqs; i++) {
+    idx = tail & *u->sqMask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = dev->fd;
+    sqe->off = blkOffset(dev, reqs[i].blockNum);
+    sqe->addr = (uintptr_t) reqs[i].buf;
+    sqe->len = BLKDEV_BLOCK_SIZE;
+    sqe->user_data = i;
+    u->sqArray[idx] = idx;
+    /* still pending */
+    reqs[i].res = 1;
+    tail++;
+  }
+  __atomic_store_n(u->sqTail, tail, __ATOMIC_RELEASE);
+  submitted = 0;
+  completed = 0;
+  while (completed < numReqs) {
+    ret = syscall(__NR_io_uring_enter, u->fd, numReqs - submitted,
+                  numReqs - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      ret = -errno;
+      /* the reads the kernel has taken may still be in flight */
+      taken = __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) - first;
+      for (;;) {
+        completed += uringReap(u, dev, reqs);
+        if (completed >= taken) {
+          break;
+        }
+        sched_yield();
+      }
+      pthread_setspecific(uringKey, (Uring *) -1);
+      uringDestroy(u);
+      for (i = 0; i < numReqs; i++) {
+        if (reqs[i].res > 0) {
+          reqs[i].res = blkRead(dev, reqs[i].blockNum, reqs[i].buf);
+        }
+      }
+      return ret;
+    }
+    submitted += ret;
+    completed += uringReap(u, dev, reqs);
+  }
+  return 0;
+}
+
+
+#endif
+
+
+/*
+ * Read a number of independent blocks. The individual results
+ * are left in the requests; the first error is returned.
+ */
+int blkReadBatch(BlkDev *dev, BlkReq *reqs, int numReqs) {
+  int i;
+  int res;
+#ifdef BLKDEV_URING
+  Uring *u;
+  int n;
+
+  u = uringGet();
+  for (i = 0; u != NULL && i < numReqs; i += n) {
+    n = numReqs - i;
+    if ((unsigned int) n > u->entries) {
+      n = u->entries;
+    }
+    if (uringReadBatch(u, dev, reqs + i, n) < 0) {
+      /* the ring is gone, the rest is read synchronously */
+      u = NULL;
+    }
+  }
+#else
+  i = 0;
+#endif
+  for (; i < numReqs; i++) {
+    reqs[i].res = blkRead(dev, reqs[i].blockNum, reqs[i].buf);
+  }
+  res = 0;
+  for (i = 0; i < numReqs; i++) {
+    if (reqs[i].res < 0) {
+      res = reqs[i].res;
+      break;
+    }
+  }
+  return res;
+}
@@ -0,0 +1,3 @@
+eos32fs.o: eos32fs.c blkdev.h gpt.h
+gpt.o: gpt.c blkdev.h gpt.h
+blkdev.o: blkdev.c blkdev.h
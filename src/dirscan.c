@@ -0,0 +1,353 @@
+/*
+ * dirscan.c -- search directory blocks for names and free slots
+ */
+
+/*
+ * A directory block is an array of 64-byte entries, each one a
+ * 4-byte inode number followed by a name of up to 60 characters,
+ * padded with null characters. An entry whose inode number is 0
+ * is free.
+ *
+ * A name matches an entry if the entry is in use and the first
+ * n bytes of its name equal those of the name including the
+ * terminating null character, with n = min(strlen(name) + 1, 60).
+ * This is exactly what strncmp(entryName, name, 60) == 0 tests.
+ * The last (up to) 16 of these bytes are compared for several
+ * entries at once with SSE2 or AVX2; only the candidates which
+ * pass are compared in full. The last bytes are taken because
+ * the names in a directory often share a long prefix, but seldom
+ * their end, which includes the terminating null. If a block
+ * still yields more than a few candidates which fail, the first
+ * 16 bytes are compared instead, and if they do no better, the
+ * rest of the block is scanned in plain C. The best variant which
+ * the processor supports is chosen at run time, other machines
+ * use plain C.
+ */
+
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define DIRSCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "dirscan.h"
+
+
+#define WINDOW_SIZE	16	/* name bytes compared in parallel */
+#define MAX_MISSES	8	/* failed candidates before plain C */
+
+
+typedef struct {
+  unsigned char bytes[DIRSCAN_NAME_SIZE];	/* name, null-padded */
+  int size;				/* number of bytes to compare */
+  int window;				/* offset of those compared first */
+  unsigned int windowMask;		/* those among them to compare */
+} Pattern;
+
+
+static void makePattern(Pattern *pat, const char *name) {
+  size_t n;
+
+  n = strlen(name) + 1;
+  if (n > DIRSCAN_NAME_SIZE) {
+    n = DIRSCAN_NAME_SIZE;
+  }
+  memset(pat->bytes, 0, DIRSCAN_NAME_SIZE);
+  memcpy(pat->bytes, name, n);
+  pat->size = n;
+  if (n >= WINDOW_SIZE) {
+    pat->window = n - WINDOW_SIZE;
+    pat->windowMask = 0xFFFF;
+  } else {
+    pat->window = 0;
+    pat->windowMask = (1u << n) - 1;
+  }
+}
+
+
+static int isFree(unsigned char *p) {
+  return (p[0] | p[1] | p[2] | p[3]) == 0;
+}
+
+
+static int entryMatches(unsigned char *p, Pattern *pat) {
+  return !isFree(p) &&
+         memcmp(p + DIRSCAN_NAME_OFF, pat->bytes, pat->size) == 0;
+}
+
+
+/**************************************************************/
+
+/* plain C */
+
+
+static int scanNameC(unsigned char *blk, int start, int numSlots,
+                     Pattern *pat) {
+  int i;
+
+  for (i = start; i < numSlots; i++) {
+    if (entryMatches(blk + i * DIRSCAN_ENTRY_SIZE, pat)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+static int scanFreeC(unsigned char *blk, int start, int numSlots) {
+  int i;
+
+  for (i = start; i < numSlots; i++) {
+    if (isFree(blk + i * DIRSCAN_ENTRY_SIZE)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+#ifdef DIRSCAN_X86
+
+
+/*
+ * Check the candidate entries in a bit set (bit j stands for
+ * slot base + j) in full, lowest slot first.
+ */
+static int checkCandidates(unsigned char *blk, int base,
+                           unsigned int cand, Pattern *pat) {
+  int j;
+
+  while (cand != 0) {
+    j = __builtin_ctz(cand);
+    if (entryMatches(blk + (base + j) * DIRSCAN_ENTRY_SIZE, pat)) {
+      return base + j;
+    }
+    cand &= cand - 1;
+  }
+  return -1;
+}
+
+
+static unsigned int getWord(unsigned char *p) {
+  unsigned int w;
+
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+
+/**************************************************************/
+
+/* SSE2, four entries per step */
+
+
+static int scanNameSSE2(unsigned char *blk, int numSlots, Pattern *pat) {
+  __m128i want;
+  unsigned char *p;
+  unsigned int mask;
+  unsigned int cand;
+  int misses;
+  int i;
+  int j;
+  int res;
+
+  want = _mm_loadu_si128((__m128i *) (pat->bytes + pat->window));
+  mask = pat->windowMask;
+  misses = 0;
+  for (i = 0; i + 4 <= numSlots; i += 4) {
+    p = blk + i * DIRSCAN_ENTRY_SIZE + DIRSCAN_NAME_OFF + pat->window;
+    cand = 0;
+    for (j = 0; j < 4; j++) {
+      if ((_mm_movemask_epi8(
+             _mm_cmpeq_epi8(
+               _mm_loadu_si128((__m128i *) (p + j * DIRSCAN_ENTRY_SIZE)),
+               want)) & mask) == mask) {
+        cand |= 1u << j;
+      }
+    }
+    if (cand != 0) {
+      res = checkCandidates(blk, i, cand, pat);
+      if (res >= 0) {
+        return res;
+      }
+      misses += __builtin_popcount(cand);
+      if (misses > MAX_MISSES) {
+        if (pat->window == 0) {
+          return scanNameC(blk, i + 4, numSlots, pat);
+        }
+        /* the names share their end, try their start */
+        pat->window = 0;
+        want = _mm_loadu_si128((__m128i *) pat->bytes);
+        misses = 0;
+      }
+    }
+  }
+  return scanNameC(blk, i, numSlots, pat);
+}
+
+
+static int scanFreeSSE2(unsigned char *blk, int numSlots) {
+  __m128i inos;
+  unsigned char *p;
+  unsigned int free;
+  int i;
+
+  for (i = 0; i + 4 <= numSlots; i += 4) {
+    p = blk + i * DIRSCAN_ENTRY_SIZE;
+    /* not _mm_setr_epi32(), which may go through memory */
+    inos = _mm_unpacklo_epi64(
+             _mm_unpacklo_epi32(
+               _mm_cvtsi32_si128(getWord(p + 0 * DIRSCAN_ENTRY_SIZE)),
+               _mm_cvtsi32_si128(getWord(p + 1 * DIRSCAN_ENTRY_SIZE))),
+             _mm_unpacklo_epi32(
+               _mm_cvtsi32_si128(getWord(p + 2 * DIRSCAN_ENTRY_SIZE)),
+               _mm_cvtsi32_si128(getWord(p + 3 * DIRSCAN_ENTRY_SIZE))));
+    free = _mm_movemask_ps(
+             _mm_castsi128_ps(_mm_cmpeq_epi32(inos, _mm_setzero_si128())));
+    if (free != 0) {
+      return i + __builtin_ctz(free);
+    }
+  }
+  return scanFreeC(blk, i, numSlots);
+}
+
+
+/**************************************************************/
+
+/* AVX2, eight entries per step */
+
+
+__attribute__((target("avx2")))
+static int scanNameAVX2(unsigned char *blk, int numSlots, Pattern *pat) {
+  __m256i want;
+  __m256i pair;
+  unsigned char *p;
+  unsigned int mask;
+  unsigned int cand;
+  unsigned int m;
+  int misses;
+  int i;
+  int j;
+  int res;
+
+  want = _mm256_broadcastsi128_si256(
+           _mm_loadu_si128((__m128i *) (pat->bytes + pat->window)));
+  mask = pat->windowMask;
+  misses = 0;
+  for (i = 0; i + 8 <= numSlots; i += 8) {
+    p = blk + i * DIRSCAN_ENTRY_SIZE + DIRSCAN_NAME_OFF + pat->window;
+    cand = 0;
+    for (j = 0; j < 8; j += 2) {
+      /* two entries in one register */
+      pair = _mm256_inserti128_si256(
+               _mm256_castsi128_si256(
+                 _mm_loadu_si128((__m128i *) (p + j * DIRSCAN_ENTRY_SIZE))),
+               _mm_loadu_si128((__m128i *) (p + (j + 1) * DIRSCAN_ENTRY_SIZE)),
+               1);
+      m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, want));
+      if ((m & mask) == mask) {
+        cand |= 1u << j;
+      }
+      if (((m >> 16) & mask) == mask) {
+        cand |= 2u << j;
+      }
+    }
+    if (cand != 0) {
+      res = checkCandidates(blk, i, cand, pat);
+      if (res >= 0) {
+        return res;
+      }
+      misses += __builtin_popcount(cand);
+      if (misses > MAX_MISSES) {
+        if (pat->window == 0) {
+          return scanNameC(blk, i + 8, numSlots, pat);
+        }
+        /* the names share their end, try their start */
+        pat->window = 0;
+        want = _mm256_broadcastsi128_si256(
+                 _mm_loadu_si128((__m128i *) pat->bytes));
+        misses = 0;
+      }
+    }
+  }
+  return scanNameC(blk, i, numSlots, pat);
+}
+
+
+__attribute__((target("avx2")))
+static int scanFreeAVX2(unsigned char *blk, int numSlots) {
+  __m256i index;
+  __m256i inos;
+  unsigned int free;
+  int i;
+
+  /* the inode numbers are 16 words apart */
+  index = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+  for (i = 0; i + 8 <= numSlots; i += 8) {
+    inos = _mm256_i32gather_epi32((int *) (blk + i * DIRSCAN_ENTRY_SIZE),
+                                  index, 4);
+    free = _mm256_movemask_ps(
+             _mm256_castsi256_ps(
+               _mm256_cmpeq_epi32(inos, _mm256_setzero_si256())));
+    if (free != 0) {
+      return i + __builtin_ctz(free);
+    }
+  }
+  return scanFreeC(blk, i, numSlots);
+}
+
+
+static int haveAVX2(void) {
+  static int avx2 = -1;
+
+  if (avx2 < 0) {
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return avx2;
+}
+
+
+#endif /* DIRSCAN_X86 */
+
+
+/**************************************************************/
+
+
+/*
+ * Find the entry with the given name among the first numSlots
+ * entries of a directory block. Returns the entry's slot number,
+ * or -1 if there is none.
+ */
+int dirScanName(unsigned char *blk, int numSlots, const char *name) {
+  Pattern pat;
+
+  makePattern(&pat, name);
+#ifdef DIRSCAN_X86
+  if (haveAVX2()) {
+    return scanNameAVX2(blk, numSlots, &pat);
+  }
+  return scanNameSSE2(blk, numSlots, &pat);
+#else
+  return scanNameC(blk, 0, numSlots, &pat);
+#endif
+}
+
+
+/*
+ * Find the first free entry among the first numSlots entries
+ * of a directory block. Returns its slot number, or -1 if all
+ * entries are in use.
+ */
+int dirScanFree(unsigned char *blk, int numSlots) {
+#ifdef DIRSCAN_X86
+  if (haveAVX2()) {
+    return scanFreeAVX2(blk, numSlots);
+  }
+  return scanFreeSSE2(blk, numSlots);
+#else
+  return scanFreeC(blk, 0, numSlots);
+#endif
+}
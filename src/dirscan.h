@@ -0,0 +1,18 @@
+/*
+ * dirscan.h -- search directory blocks for names and free slots
+ */
+
+
+#ifndef _DIRSCAN_H_
+#define _DIRSCAN_H_
+
+
+#define DIRSCAN_ENTRY_SIZE	64	/* size of a directory entry */
+#define DIRSCAN_NAME_OFF	4	/* offset of the name in an entry */
+#define DIRSCAN_NAME_SIZE	60	/* max length of a name */
+
+
+int dirScanName(unsigned char *blk, int numSlots, const char *name);
+int dirScanFree(unsigned char *blk, int numSlots);
+
+#endif /* _DIRSCAN_H_ */
@@ -1,5 +1,5 @@
 /*
- * eos32fs.c -- EOS32 file system driver (just a dummy for now)
+ * eos32fs.c -- EOS32 file system driver
  */
 
 
@@ -7,46 +7,6831 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
-#define FUSE_USE_VERSION	31
-#include <fuse3/fuse.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#define FUSE_USE_VERSION	312
+#include <fuse3/fuse_lowlevel.h>
 
+#include "blkdev.h"
+#include "dirscan.h"
 #include "gpt.h"
 
 
-#define SECTOR_SIZE	512
-#define BLOCK_SIZE	4096
+#define SECTOR_SIZE	512	/* disk sector size in bytes */
+#define BLOCK_SIZE	4096	/* disk block size in bytes */
 #define SPB		(BLOCK_SIZE / SECTOR_SIZE)
 
+#define NICINOD		500	/* number of free inodes in superblock */
+#define NICFREE		500	/* number of free blocks in superblock */
+#define NADDR		8	/* number of block addresses in inode */
+#define NDADDR		6	/* number of direct block addresses */
+#define SINGLE_INDIR	(NDADDR + 0)	/* index of single indirect block */
+#define DOUBLE_INDIR	(NDADDR + 1)	/* index of double indirect block */
+#define DIRSIZ		60	/* max length of a path name component */
+
+#define INODE_SIZE	64	/* size of an inode on disk in bytes */
+#define DIRENT_SIZE	64	/* size of a directory entry in bytes */
+#define NIPB		(BLOCK_SIZE / INODE_SIZE)
+#define NDIRENT		(BLOCK_SIZE / DIRENT_SIZE)
+#define NINDIR		(BLOCK_SIZE / sizeof(EOS32_daddr_t))
+
+#define SUPER_MAGIC	0x44FCB67D
+#define ROOT_INO	1	/* inode number of root directory */
+
+#define IFMT		070000	/* type of file */
+#define   IFREG		040000	/* regular file */
+#define   IFDIR		030000	/* directory */
+#define   IFCHR		020000	/* character special */
+#define   IFBLK		010000	/* block special */
+#define   IFFREE	000000	/* reserved (indicates free inode) */
+#define ISUID		004000	/* set user id on execution */
+#define ISGID		002000	/* set group id on execution */
+#define ISVTX		001000	/* save swapped text even after use */
+
+/*
+ * The following two macros convert an inode number to the disk
+ * block containing the inode and an inode number within the block.
+ */
+#define itod(i)		(2 + (i) / NIPB)
+#define itoo(i)		((i) % NIPB)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE	(1 << 0)	/* rename flag of Linux */
+#endif
+
+#define ATTR_TIMEOUT	1.0	/* seconds the kernel may cache attributes */
+#define ENTRY_TIMEOUT	1.0	/* seconds the kernel may cache names */
+
+#define MAX_SPLICE_BUFS	8	/* buffers in a spliced read reply */
+#define ZERO_BLOCKS	256	/* zeros for holes, the largest read */
+#define MAX_BACKGROUND	64	/* kernel's outstanding async requests */
+
+#define RA_MIN		4	/* first readahead window in blocks */
+#define RA_MAX		64	/* largest readahead window in blocks */
+
+#define PREALLOC_BLOCKS	32	/* blocks reserved for a file's appends */
+#define RUN_TRIES	64	/* free runs looked at for a new run */
+
+#define DI_EMPTY	0xFFFFFFFF	/* directory index entry never used */
+#define DI_DELETED	0xFFFFFFFE	/* directory index entry deleted */
+#define DI_BUDGET	(1 << 20)	/* index entries in all directories */
+
+#define BLOOM_BITS	16	/* filter bits per directory entry slot */
+#define BLOOM_HASHES	4	/* bits set per name */
+
+
+/**************************************************************/
+
+
+/* EOS32 types */
+
+typedef unsigned int EOS32_ino_t;
+typedef unsigned int EOS32_daddr_t;
+typedef unsigned int EOS32_off_t;
+typedef int EOS32_time_t;
+
+
+/* super block, as far as the driver needs it */
+
+typedef struct {
+  unsigned int s_magic;			/* must be SUPER_MAGIC */
+  EOS32_daddr_t s_fsize;		/* size of file system in blocks */
+  EOS32_daddr_t s_isize;		/* size of inode list in blocks */
+  EOS32_daddr_t s_freeblks;		/* number of free blocks */
+  EOS32_ino_t s_freeinos;		/* number of free inodes */
+} Filsys;
+
+
+/* blocks reserved for the next appends to a file */
+
+typedef struct {
+  EOS32_daddr_t start;			/* first reserved block */
+  EOS32_daddr_t count;			/* number of reserved blocks */
+} Prealloc;
+
+
+/* file data block which has no disk block yet */
+
+typedef struct {
+  EOS32_daddr_t lbn;			/* logical block in file */
+  unsigned char *buf;			/* data, held in the block cache */
+} DelayedBlock;
+
+
+/* directory name index in memory */
+
+typedef struct {
+  unsigned int hash;			/* hash of the entry's name */
+  unsigned int slot;			/* entry's slot, or DI_EMPTY/DI_DELETED */
+} DirHash;
+
+typedef struct {
+  EOS32_off_t size;			/* size of directory when indexed */
+  unsigned int mask;			/* number of table entries - 1 */
+  unsigned int used;			/* table entries not empty */
+  DirHash tab[];			/* open addressing hash table */
+} DirIndex;
+
+
+/* directory name filter in memory */
+
+typedef struct {
+  EOS32_off_t size;			/* size of directory when built */
+  unsigned int mask;			/* number of bits - 1 */
+  unsigned int numNames;		/* names added */
+  unsigned int bits[];			/* Bloom filter */
+} DirBloom;
+
+
+/* inode in memory */
+
+typedef struct inode {
+  EOS32_ino_t i_number;			/* inode number */
+  unsigned int i_mode;			/* type and mode of file */
+  unsigned int i_nlink;			/* number of links to file */
+  unsigned int i_uid;			/* owner's user id */
+  unsigned int i_gid;			/* owner's group id */
+  EOS32_time_t i_ctime;			/* time created */
+  EOS32_time_t i_mtime;			/* time last modified */
+  EOS32_time_t i_atime;			/* time last accessed */
+  EOS32_off_t i_size;			/* number of bytes in file */
+  EOS32_daddr_t i_addr[NADDR];		/* block addresses */
+  /* the rest is not stored on disk */
+  unsigned int i_count;			/* references held by the driver, */
+					/* plus one while the kernel has any */
+  uint64_t i_nlookup;			/* references held by the kernel */
+  struct extMap *i_extMap;		/* block map, or NULL */
+  DirIndex *i_dirIndex;			/* name index, or NULL */
+  DirBloom *i_dirBloom;			/* name filter, or NULL */
+  EOS32_ino_t i_lastChild;		/* inode last created in directory */
+  EOS32_daddr_t i_allocGoal;		/* where to put the first block */
+  Prealloc i_prealloc;			/* blocks reserved for appends */
+  unsigned int i_writers;		/* open for writing this many times */
+  DelayedBlock *i_delayed;		/* sorted by lbn */
+  unsigned int i_numDelayed;		/* number of delayed blocks */
+  unsigned int i_maxDelayed;		/* room in i_delayed */
+  EOS32_daddr_t i_promised;		/* free blocks promised to them */
+  struct inode *i_delayNext;		/* next inode with delayed blocks */
+  int i_dirty;				/* DIRTY_xxx, if not yet stored */
+  struct inode *i_dirtyPrev;		/* neighbours in dirty list */
+  struct inode *i_dirtyNext;
+  pthread_rwlock_t i_lock;		/* guards atime updates, name index */
+  unsigned long i_retired;		/* epoch it left the cache in */
+  struct inode *i_hashNext;		/* next inode in hash chain */
+  struct inode *i_idlePrev;		/* neighbours in idle list */
+  struct inode *i_idleNext;
+} Inode;
+
+
+/**************************************************************/
+
+
+void error(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  printf("Error: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+  exit(1);
+}
+
+
+void warning(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  printf("Warning: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+}
+
+
+/**************************************************************/
+
+
+BlkDev disk;			/* the file which holds the disk image */
+unsigned int fsStart;		/* file system start sector */
+unsigned int fsSize;		/* file system size in sectors */
+Filsys filsys;			/* the file system's super block */
+
+
+int readBlock(EOS32_daddr_t blockNum, unsigned char *blockBuffer) {
+  if (blockNum >= filsys.s_fsize) {
+    return -EIO;
+  }
+  return blkRead(&disk, blockNum, blockBuffer);
+}
+
+
+unsigned int get4Bytes(unsigned char *addr) {
+  return (unsigned int) addr[0] << 24 |
+         (unsigned int) addr[1] << 16 |
+         (unsigned int) addr[2] <<  8 |
+         (unsigned int) addr[3] <<  0;
+}
+
+
+void put4Bytes(unsigned char *addr, unsigned int data) {
+  addr[0] = data >> 24;
+  addr[1] = data >> 16;
+  addr[2] = data >>  8;
+  addr[3] = data >>  0;
+}
+
+
+/**************************************************************/
+
+/* memory-mapped image */
+
+
+/*
+ * With the mmap option the file system's part of the disk image
+ * is mapped into memory once. Blocks are then decoded in place,
+ * file data is handed to FUSE straight from the mapping, and the
+ * kernel's page cache takes the role of the block cache.
+ */
+
+unsigned char *diskMap;		/* block 0 of the mapped file system */
+void *mapBase;			/* start of the (page aligned) mapping */
+size_t mapLength;		/* length of the mapping in bytes */
+unsigned char zeroBlocks[ZERO_BLOCKS * BLOCK_SIZE];	/* contents of holes */
+
+
+void mapDisk(void) {
+  off_t start;
+  off_t end;
+  off_t alignedStart;
+  long pageSize;
+
+  pageSize = sysconf(_SC_PAGESIZE);
+  start = disk.start;
+  end = start + (off_t) fsSize * SECTOR_SIZE;
+  if (end > disk.size) {
+    end = disk.size;
+  }
+  if (end < start + 2 * BLOCK_SIZE) {
+    error("disk image ends within the file system's first blocks");
+  }
+  alignedStart = start - start % pageSize;
+  mapLength = end - alignedStart;
+  mapBase = mmap(NULL, mapLength, PROT_READ, MAP_SHARED,
+                 disk.fd, alignedStart);
+  if (mapBase == MAP_FAILED) {
+    error("cannot map disk image into memory");
+  }
+  diskMap = (unsigned char *) mapBase + (start - alignedStart);
+}
+
+
+void unmapDisk(void) {
+  munmap(mapBase, mapLength);
+  diskMap = NULL;
+}
+
+
+/**************************************************************/
+
+/* lockless lookups */
+
+
+/*
+ * Requests which find what they need in the block cache or in
+ * the inode cache do so without taking a lock (see there). Such
+ * a lookup may still be looking at an inode which is just being
+ * dropped from the cache, so inodes are not freed at once, but
+ * retired. A thread notes the global epoch in its slot while it
+ * is inside a lookup, and the epoch is advanced only when every
+ * thread inside a lookup has noted the current one. An inode
+ * retired in one epoch is freed two epochs later, when nobody
+ * can be looking at it any longer.
+ *
+ * The slots also count the lookups which hit, so that these do
+ * not write to a cache line which all threads share. A slot is
+ * given back when its thread ends, and reused by a new thread.
+ */
+
+
+#define RETIRE_BATCH	32	/* retired inodes which may wait */
+
+
+typedef struct threadSlot {
+  unsigned long epoch;		/* epoch of current lookup, or 0 */
+  int inUse;			/* owned by a thread */
+  unsigned long blockHits;	/* lockless hits in block cache */
+  unsigned long inodeHits;	/* lockless hits in inode cache */
+  struct threadSlot *next;	/* next slot */
+} __attribute__((aligned(64))) ThreadSlot;
+
+
+static pthread_once_t slotOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotKey;
+ThreadSlot *threadSlots;	/* all slots, never freed */
+unsigned long globalEpoch = 1;	/* never 0, which means outside */
+/* guards the list of retired inodes and advancing the epoch */
+pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+Inode *retiredInodes;		/* linked by i_idleNext */
+int numRetired;			/* number of retired inodes */
+
+
+static void slotRelease(void *arg) {
+  ThreadSlot *slot;
+
+  slot = arg;
+  __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->inUse, 0, __ATOMIC_RELEASE);
+}
+
+
+static void slotKeyCreate(void) {
+  pthread_key_create(&slotKey, slotRelease);
+}
+
+
+/*
+ * Get the calling thread's slot. Returns NULL if there is none
+ * and no memory for a new one, in which case lookups must lock.
+ */
+static ThreadSlot *getSlot(void) {
+  ThreadSlot *slot;
+  int unused;
+
+  pthread_once(&slotOnce, slotKeyCreate);
+  slot = pthread_getspecific(slotKey);
+  if (slot != NULL) {
+    return slot;
+  }
+  for (slot = __atomic_load_n(&threadSlots, __ATOMIC_ACQUIRE);
+       slot != NULL;
+       slot = slot->next) {
+    unused = 0;
+    if (__atomic_compare_exchange_n(&slot->inUse, &unused, 1, 0,
+                                    __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (slot == NULL) {
+    if (posix_memalign((void **) &slot, sizeof(ThreadSlot),
+                       sizeof(ThreadSlot)) != 0) {
+      return NULL;
+    }
+    memset(slot, 0, sizeof(ThreadSlot));
+    slot->inUse = 1;
+    do {
+      slot->next = __atomic_load_n(&threadSlots, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&threadSlots, &slot->next, slot,
+                                          0, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+  }
+  pthread_setspecific(slotKey, slot);
+  return slot;
+}
+
+
+static void enterEpoch(ThreadSlot *slot) {
+  unsigned long epoch;
+
+  epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  while (1) {
+    __atomic_store_n(&slot->epoch, epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST) == epoch) {
+      break;
+    }
+    /* advanced meanwhile, note the new one */
+    epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  }
+}
+
+
+static void leaveEpoch(ThreadSlot *slot) {
+  __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Advance the epoch if every thread inside a lookup has noted
+ * the current one, and free the retired inodes which nobody can
+ * be looking at. Must be called with retireLock held.
+ */
+static void reclaimRetired(void) {
+  ThreadSlot *slot;
+  unsigned long epoch;
+  unsigned long noted;
+  Inode **pp;
+  Inode *ip;
+
+  epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  for (slot = __atomic_load_n(&threadSlots, __ATOMIC_ACQUIRE);
+       slot != NULL;
+       slot = slot->next) {
+    noted = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+    if (noted != 0 && noted != epoch) {
+      break;
+    }
+  }
+  if (slot == NULL) {
+    epoch++;
+    __atomic_store_n(&globalEpoch, epoch, __ATOMIC_SEQ_CST);
+  }
+  pp = &retiredInodes;
+  while (*pp != NULL) {
+    ip = *pp;
+    if (ip->i_retired + 2 <= epoch) {
+      *pp = ip->i_idleNext;
+      free(ip);
+      numRetired--;
+    } else {
+      pp = &ip->i_idleNext;
+    }
+  }
+}
+
+
+/*
+ * Free an inode which has been taken out of the inode cache, as
+ * soon as no lockless lookup can be looking at it any longer.
+ */
+static void retireInode(Inode *ip) {
+  pthread_mutex_lock(&retireLock);
+  ip->i_retired = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  ip->i_idleNext = retiredInodes;
+  retiredInodes = ip;
+  if (++numRetired >= RETIRE_BATCH) {
+    reclaimRetired();
+  }
+  pthread_mutex_unlock(&retireLock);
+}
+
+
+/*
+ * Sum up the lockless hits of all threads.
+ */
+static void countLocklessHits(unsigned long *blockHits,
+                              unsigned long *inodeHits) {
+  ThreadSlot *slot;
+
+  *blockHits = 0;
+  *inodeHits = 0;
+  for (slot = __atomic_load_n(&threadSlots, __ATOMIC_ACQUIRE);
+       slot != NULL;
+       slot = slot->next) {
+    *blockHits += __atomic_load_n(&slot->blockHits, __ATOMIC_RELAXED);
+    *inodeHits += __atomic_load_n(&slot->inodeHits, __ATOMIC_RELAXED);
+  }
+}
+
+
+/**************************************************************/
+
+/* block cache */
+
+
+/*
+ * All metadata blocks (super block, inodes, indirect blocks,
+ * directories) are accessed through a cache of raw disk blocks.
+ * A block is held by getBlock() until it is given back with
+ * putBlock(); held blocks are never evicted. Otherwise blocks
+ * are replaced with the CLOCK algorithm. The super block and,
+ * up to half of the cache, the inode-table blocks are pinned
+ * once read, because nearly every request touches them again.
+ *
+ * Requests are processed by several threads (see "request
+ * locking"), so the cache is split into up to CACHE_SHARDS
+ * shards of equal size, each with its own lock, hash table and
+ * CLOCK hand. A block always lives in the shard its number
+ * hashes to. A block is read from the disk without the shard's
+ * lock held; it is entered first and marked CB_READING, so that
+ * others who want it wait for the read instead of issuing their
+ * own.
+ *
+ * Blocks which are in the cache are found without taking the
+ * shard's lock at all: the hash chain is walked, and a reference
+ * is taken by incrementing the entry's reference count, unless
+ * the count is -1. An entry is set to -1 (claimed) under the
+ * shard's lock while it gets another block or starts to be
+ * written back, and nobody may hold it then. After getting the
+ * reference, the lookup checks that the entry still holds its
+ * block. A lookup which is led astray by an entry moving to
+ * another chain just misses, and takes the lock. Lookups which
+ * must not miss, like isDirty(), notice the move by the shard's
+ * sequence number, which is odd while its chains change.
+ *
+ * Modified blocks are only marked dirty. A flusher thread writes
+ * them back, sorted by block number and with adjacent blocks
+ * combined into a single pwritev(), when the oldest of them has
+ * been dirty for DIRTY_EXPIRE seconds, when a DIRTY_RATIO part
+ * of the cache is dirty, or when the kernel flushes a file.
+ * fsync and unmounting write them back synchronously. A block
+ * is picked for write-back only while nobody holds it, and
+ * getBlock() waits for a block which is being written, so that
+ * it cannot change meanwhile. Dirty blocks and blocks being
+ * written are never evicted. The counters of dirty blocks and
+ * the state of the flusher are guarded by flushLock, which is
+ * taken after a shard's lock if both are needed.
+ *
+ * File data which has no disk block yet is held in entries which
+ * are not hashed and not evicted either, until it gets a block
+ * with assignBlock() (see "delayed allocation").
+ */
+
+#define DEF_CACHE_MB	16	/* default size of block cache in MiB */
+#define MIN_CACHE_BLKS	64	/* minimum number of blocks in cache */
+#define CACHE_SHARDS	16	/* maximum number of cache shards */
+#define SHARD_BLKS	256	/* minimum number of blocks per shard */
+#define MAX_PREFETCH	32	/* maximum number of blocks prefetched */
+#define DIRTY_EXPIRE	5	/* seconds a block may stay dirty */
+#define DIRTY_RATIO	4	/* flush if 1/DIRTY_RATIO of cache dirty */
+#define FLUSH_INTERVAL	1	/* seconds between flusher checks */
+
+#define NOBLOCK		((EOS32_daddr_t) -1)
+
+#define CB_PINNED	0x02	/* block is never evicted */
+#define CB_DIRTY	0x04	/* block must be written back */
+#define CB_WRITEBACK	0x08	/* block is being written back */
+#define CB_DELAYED	0x10	/* data has no disk block yet */
+#define CB_READING	0x20	/* block is being read from disk */
+
+
+typedef struct {
+  EOS32_daddr_t bno;		/* disk block held, or NOBLOCK */
+  int refcnt;			/* number of current users, -1 if claimed */
+  int flags;			/* CB_xxx */
+  int referenced;		/* block was used since last sweep */
+  int hashNext;			/* next entry in hash chain, or -1 */
+} CacheEntry;
+
+
+typedef struct {
+  pthread_mutex_t lock;		/* guards the shard's entries */
+  pthread_cond_t cond;		/* broadcast when a read or write ends */
+  unsigned int seq;		/* odd while hash chains change */
+  int first;			/* index of the shard's first entry */
+  int *hash;			/* hash chain heads, -1 if empty */
+  int hand;			/* the CLOCK hand, relative to first */
+  int pinned;			/* number of pinned entries */
+  unsigned long hits;		/* number of requests found in shard */
+  unsigned long misses;		/* number of requests read from disk */
+} CacheShard;
+
+
+CacheEntry *cacheEntries;	/* the cache's entries */
+unsigned char *cacheData;	/* one block of data per entry */
+int cacheSize;			/* number of entries */
+CacheShard cacheShards[CACHE_SHARDS];
+int numShards;			/* number of shards, a power of 2 */
+int shardSize;			/* number of entries per shard */
+unsigned int cacheHashMask;	/* number of hash chains per shard - 1 */
+int anonShard;			/* shard for the next anonymous block */
+
+/* taken shared or exclusively while a request is processed */
+pthread_rwlock_t fsLock = PTHREAD_RWLOCK_INITIALIZER;
+/* guards the counters below and the flusher's state */
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+/* signalled to wake the flusher */
+pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;
+/* broadcast when a write-back has completed */
+pthread_cond_t writebackCond = PTHREAD_COND_INITIALIZER;
+pthread_t flusherThread;	/* writes dirty blocks back */
+int flusherStop;		/* tells the flusher to terminate */
+int flushWanted;		/* flusher should write back now */
+int numDirty;			/* number of dirty entries */
+int numWriteback;		/* number of entries being written */
+time_t dirtySince;		/* when the oldest dirty block was dirtied */
+int numDelayed;			/* number of entries without disk block */
+time_t delayedSince;		/* when the oldest of them was created */
+int flushError;			/* error of a write-back, for fsync */
+unsigned long flushWrites;	/* number of write-back system calls */
+unsigned long flushBlocks;	/* number of blocks written back */
+
+
+void initCache(unsigned int cacheMB) {
+  CacheShard *sh;
+  unsigned int numHash;
+  int i;
+  int s;
+
+  cacheSize = cacheMB * ((1 << 20) / BLOCK_SIZE);
+  if (cacheSize < MIN_CACHE_BLKS) {
+    cacheSize = MIN_CACHE_BLKS;
+  }
+  numShards = 1;
+  while (numShards < CACHE_SHARDS &&
+         cacheSize / (2 * numShards) >= SHARD_BLKS) {
+    numShards *= 2;
+  }
+  shardSize = cacheSize / numShards;
+  cacheSize = shardSize * numShards;
+  numHash = 1;
+  while (numHash < shardSize) {
+    numHash <<= 1;
+  }
+  cacheHashMask = numHash - 1;
+  cacheEntries = malloc(cacheSize * sizeof(CacheEntry));
+  cacheData = malloc((size_t) cacheSize * BLOCK_SIZE);
+  if (cacheEntries == NULL || cacheData == NULL) {
+    error("cannot allocate block cache of %d blocks", cacheSize);
+  }
+  for (i = 0; i < cacheSize; i++) {
+    cacheEntries[i].bno = NOBLOCK;
+    cacheEntries[i].refcnt = 0;
+    cacheEntries[i].flags = 0;
+    cacheEntries[i].referenced = 0;
+    cacheEntries[i].hashNext = -1;
+  }
+  for (s = 0; s < numShards; s++) {
+    sh = &cacheShards[s];
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->cond, NULL);
+    sh->seq = 0;
+    sh->first = s * shardSize;
+    sh->hash = malloc(numHash * sizeof(int));
+    if (sh->hash == NULL) {
+      error("cannot allocate block cache of %d blocks", cacheSize);
+    }
+    for (i = 0; i < numHash; i++) {
+      sh->hash[i] = -1;
+    }
+    sh->hand = 0;
+    sh->pinned = 0;
+    sh->hits = 0;
+    sh->misses = 0;
+  }
+  anonShard = 0;
+  numDirty = 0;
+  numWriteback = 0;
+  numDelayed = 0;
+  flushError = 0;
+  flushWrites = 0;
+  flushBlocks = 0;
+}
+
+
+/*
+ * The low bits of a block's hash select its hash chain, the high
+ * bits its shard.
+ */
+static unsigned int cacheHashFn(EOS32_daddr_t bno) {
+  return (bno * 0x9E3779B1) & cacheHashMask;
+}
+
+
+static CacheShard *blockShard(EOS32_daddr_t bno) {
+  return &cacheShards[((bno * 0x9E3779B1) >> 24) & (numShards - 1)];
+}
+
+
+static CacheShard *entryShard(int i) {
+  return &cacheShards[i / shardSize];
+}
+
+
+static int entryOf(unsigned char *p) {
+  return (p - cacheData) / BLOCK_SIZE;
+}
+
+
+/*
+ * The hash chains of a shard are changed between hashBegin() and
+ * hashEnd(), with the shard's lock held.
+ */
+static void hashBegin(CacheShard *sh) {
+  __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void hashEnd(CacheShard *sh) {
+  __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Entry flags are read by lockless lookups, and only changed
+ * with the shard's lock held.
+ */
+static void setFlags(CacheEntry *ce, int flags) {
+  __atomic_store_n(&ce->flags, flags, __ATOMIC_RELEASE);
+}
+
+
+static void cacheUnhash(CacheShard *sh, int i) {
+  CacheEntry *ce;
+  int *pp;
+
+  ce = &cacheEntries[i];
+  hashBegin(sh);
+  pp = &sh->hash[cacheHashFn(ce->bno)];
+  while (*pp != i) {
+    pp = &cacheEntries[*pp].hashNext;
+  }
+  __atomic_store_n(pp, ce->hashNext, __ATOMIC_RELAXED);
+  __atomic_store_n(&ce->bno, NOBLOCK, __ATOMIC_RELAXED);
+  hashEnd(sh);
+  if ((ce->flags & CB_PINNED) != 0) {
+    setFlags(ce, ce->flags & ~CB_PINNED);
+    sh->pinned--;
+  }
+}
+
+
+/*
+ * Claim an entry which nobody holds, so that no lockless lookup
+ * can get it while it changes. Must be called with the shard's
+ * lock held. The claim ends with unclaimEntry(), which sets the
+ * entry's reference count.
+ */
+static int claimEntry(CacheEntry *ce) {
+  int unused;
+
+  unused = 0;
+  return __atomic_compare_exchange_n(&ce->refcnt, &unused, -1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+static void unclaimEntry(CacheEntry *ce, int refcnt) {
+  __atomic_store_n(&ce->refcnt, refcnt, __ATOMIC_RELEASE);
+}
+
+
+static int compareBlocks(const void *p1, const void *p2) {
+  EOS32_daddr_t bno1;
+  EOS32_daddr_t bno2;
+
+  bno1 = cacheEntries[*(int *) p1].bno;
+  bno2 = cacheEntries[*(int *) p2].bno;
+  return bno1 < bno2 ? -1 : bno1 > bno2 ? 1 : 0;
+}
+
+
+/*
+ * Wake the flusher if it has something to do. Must be called
+ * with flushLock held.
+ */
+static void signalFlusher(void) {
+  if (numDirty + numDelayed != 0 && !flushWanted) {
+    flushWanted = 1;
+    pthread_cond_signal(&flushCond);
+  }
+}
+
+
+/*
+ * Write all dirty blocks which nobody holds back to the disk, in
+ * ascending order, one system call per run of adjacent blocks.
+ * Must be called with fsLock held; if unlock is set, the lock is
+ * given up as soon as the blocks have been picked. Blocks which
+ * cannot be written stay dirty.
+ */
+static int writeBack(int unlock) {
+  CacheShard *sh;
+  CacheEntry *ce;
+  int *list;
+  EOS32_daddr_t *bnos;
+  struct iovec *iov;
+  int *failed;
+  int max;
+  int n;
+  int i;
+  int j;
+  int k;
+  int s;
+  int writes;
+  int redirtied;
+  int res;
+  int r;
+
+  pthread_mutex_lock(&flushLock);
+  max = numDirty;
+  pthread_mutex_unlock(&flushLock);
+  list = NULL;
+  bnos = NULL;
+  iov = NULL;
+  failed = NULL;
+  res = 0;
+  if (max != 0) {
+    list = malloc(max * sizeof(int));
+    bnos = malloc(max * sizeof(EOS32_daddr_t));
+    iov = malloc(max * sizeof(struct iovec));
+    failed = calloc(max, sizeof(int));
+    if (list == NULL || bnos == NULL || iov == NULL || failed == NULL) {
+      res = -ENOMEM;
+    }
+  }
+  if (max == 0 || res < 0) {
+    if (unlock) {
+      pthread_rwlock_unlock(&fsLock);
+    }
+    free(list);
+    free(bnos);
+    free(iov);
+    free(failed);
+    return res;
+  }
+  n = 0;
+  for (s = 0; s < numShards && n < max; s++) {
+    sh = &cacheShards[s];
+    pthread_mutex_lock(&sh->lock);
+    for (i = sh->first; i < sh->first + shardSize && n < max; i++) {
+      ce = &cacheEntries[i];
+      if ((ce->flags & CB_DIRTY) != 0 && claimEntry(ce)) {
+        setFlags(ce, (ce->flags & ~CB_DIRTY) | CB_WRITEBACK);
+        unclaimEntry(ce, 0);
+        list[n++] = i;
+      }
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+  pthread_mutex_lock(&flushLock);
+  numDirty -= n;
+  numWriteback += n;
+  pthread_mutex_unlock(&flushLock);
+  if (unlock) {
+    pthread_rwlock_unlock(&fsLock);
+  }
+  qsort(list, n, sizeof(int), compareBlocks);
+  for (i = 0; i < n; i++) {
+    bnos[i] = cacheEntries[list[i]].bno;
+    iov[i].iov_base = cacheData + (size_t) list[i] * BLOCK_SIZE;
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+  writes = 0;
+  for (i = 0; i < n; i = j) {
+    j = i + 1;
+    while (j < n && bnos[j] == bnos[j - 1] + 1) {
+      j++;
+    }
+    r = blkWritev(&disk, bnos[i], iov + i, j - i);
+    if (r < 0) {
+      res = r;
+      for (k = i; k < j; k++) {
+        failed[k] = 1;
+      }
+    }
+    writes++;
+  }
+  redirtied = 0;
+  for (i = 0; i < n; i++) {
+    ce = &cacheEntries[list[i]];
+    sh = entryShard(list[i]);
+    pthread_mutex_lock(&sh->lock);
+    if (failed[i] && (ce->flags & CB_DIRTY) == 0) {
+      setFlags(ce, (ce->flags & ~CB_WRITEBACK) | CB_DIRTY);
+      redirtied++;
+    } else {
+      setFlags(ce, ce->flags & ~CB_WRITEBACK);
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+  for (s = 0; s < numShards; s++) {
+    pthread_cond_broadcast(&cacheShards[s].cond);
+  }
+  pthread_mutex_lock(&flushLock);
+  if (redirtied != 0 && numDirty == 0) {
+    dirtySince = time(NULL);
+  }
+  numDirty += redirtied;
+  numWriteback -= n;
+  flushBlocks += n;
+  flushWrites += writes;
+  pthread_cond_broadcast(&writebackCond);
+  pthread_mutex_unlock(&flushLock);
+  free(list);
+  free(bnos);
+  free(iov);
+  free(failed);
+  return res;
+}
+
+
+/*
+ * Wait until no block is being written back by the flusher.
+ * Must be called with flushLock held.
+ */
+static void waitWriteback(void) {
+  while (numWriteback != 0) {
+    pthread_cond_wait(&writebackCond, &flushLock);
+  }
+}
+
+
+/*
+ * Ask the flusher to write back all dirty blocks soon.
+ */
+void wakeFlusher(void) {
+  pthread_mutex_lock(&flushLock);
+  signalFlusher();
+  pthread_mutex_unlock(&flushLock);
+}
+
+
+/*
+ * Write back all dirty blocks, including those the flusher is
+ * busy with, and wait until they have reached the disk. An error
+ * of an earlier write-back by the flusher is reported here.
+ */
+int flushCache(void) {
+  int res;
+
+  if (diskMap != NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&flushLock);
+  waitWriteback();
+  pthread_mutex_unlock(&flushLock);
+  res = writeBack(0);
+  pthread_mutex_lock(&flushLock);
+  if (res == 0 && flushError != 0) {
+    res = flushError;
+  }
+  flushError = 0;
+  pthread_mutex_unlock(&flushLock);
+  if (res == 0) {
+    res = blkSync(&disk);
+  }
+  return res;
+}
+
+
+/*
+ * Advance a shard's CLOCK hand to find an entry to hold a new
+ * block, giving every recently used block a second chance. The
+ * entry is returned claimed.
+ */
+static int cacheSweep(CacheShard *sh) {
+  CacheEntry *ce;
+  int n;
+
+  for (n = 0; n < 2 * shardSize; n++) {
+    ce = &cacheEntries[sh->first + sh->hand];
+    sh->hand = (sh->hand + 1) % shardSize;
+    if (__atomic_load_n(&ce->refcnt, __ATOMIC_RELAXED) != 0 ||
+        (ce->flags & (CB_PINNED | CB_DIRTY | CB_WRITEBACK |
+                      CB_DELAYED)) != 0) {
+      continue;
+    }
+    if (__atomic_load_n(&ce->referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&ce->referenced, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!claimEntry(ce)) {
+      /* just taken by a lockless lookup */
+      continue;
+    }
+    if (ce->bno != NOBLOCK) {
+      cacheUnhash(sh, ce - cacheEntries);
+    }
+    return ce - cacheEntries;
+  }
+  return -1;
+}
+
+
+/*
+ * Find an entry of a shard to hold a new block, and claim it.
+ * Must be called with the shard's lock held. If all candidates
+ * are dirty, they are written back first, with the lock given
+ * up meanwhile, so the caller must look for its block again.
+ */
+static int cacheVictim(CacheShard *sh) {
+  int i;
+
+  i = cacheSweep(sh);
+  if (i == -1) {
+    pthread_mutex_unlock(&sh->lock);
+    pthread_mutex_lock(&flushLock);
+    waitWriteback();
+    pthread_mutex_unlock(&flushLock);
+    writeBack(0);
+    pthread_mutex_lock(&sh->lock);
+    i = cacheSweep(sh);
+  }
+  return i;
+}
+
+
+static int isPinnable(CacheShard *sh, EOS32_daddr_t bno) {
+  if (bno == 1) {
+    return 1;
+  }
+  return bno >= 2 && bno < 2 + filsys.s_isize &&
+         sh->pinned < shardSize / 2;
+}
+
+
+static int cacheLookup(CacheShard *sh, EOS32_daddr_t bno) {
+  int i;
+
+  for (i = sh->hash[cacheHashFn(bno)];
+       i != -1;
+       i = cacheEntries[i].hashNext) {
+    if (cacheEntries[i].bno == bno) {
+      break;
+    }
+  }
+  return i;
+}
+
+
+/*
+ * Enter a claimed entry into a shard's hash table.
+ */
+static void cacheInsert(CacheShard *sh, int i, EOS32_daddr_t bno) {
+  CacheEntry *ce;
+  unsigned int h;
+
+  ce = &cacheEntries[i];
+  h = cacheHashFn(bno);
+  hashBegin(sh);
+  __atomic_store_n(&ce->bno, bno, __ATOMIC_RELAXED);
+  __atomic_store_n(&ce->hashNext, sh->hash[h], __ATOMIC_RELAXED);
+  __atomic_store_n(&sh->hash[h], i, __ATOMIC_RELEASE);
+  hashEnd(sh);
+  if (isPinnable(sh, bno)) {
+    setFlags(ce, ce->flags | CB_PINNED);
+    sh->pinned++;
+  }
+}
+
+
+/*
+ * Get a reference to a block without taking its shard's lock.
+ * Returns the block's entry, or -1 if the lock must be taken,
+ * because the block is missing, being read or written, or its
+ * entry is just changing.
+ */
+static int cacheGetLockless(CacheShard *sh, EOS32_daddr_t bno) {
+  CacheEntry *ce;
+  int i;
+  int n;
+  int r;
+
+  i = __atomic_load_n(&sh->hash[cacheHashFn(bno)], __ATOMIC_ACQUIRE);
+  for (n = 0; i != -1 && n < shardSize; n++) {
+    ce = &cacheEntries[i];
+    if (__atomic_load_n(&ce->bno, __ATOMIC_RELAXED) == bno) {
+      break;
+    }
+    i = __atomic_load_n(&ce->hashNext, __ATOMIC_ACQUIRE);
+  }
+  if (i == -1 || n == shardSize) {
+    return -1;
+  }
+  r = __atomic_load_n(&ce->refcnt, __ATOMIC_RELAXED);
+  do {
+    if (r < 0) {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&ce->refcnt, &r, r + 1, 1,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED));
+  /* the flags first: a failed read unhashes its entry before
+     CB_READING goes */
+  if ((__atomic_load_n(&ce->flags, __ATOMIC_ACQUIRE) &
+       (CB_READING | CB_WRITEBACK)) != 0 ||
+      __atomic_load_n(&ce->bno, __ATOMIC_RELAXED) != bno) {
+    __atomic_sub_fetch(&ce->refcnt, 1, __ATOMIC_RELEASE);
+    return -1;
+  }
+  if (!__atomic_load_n(&ce->referenced, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+  }
+  return i;
+}
+
+
+/*
+ * Count a lockless hit in the calling thread's slot.
+ */
+static void countBlockHit(ThreadSlot *slot) {
+  __atomic_store_n(&slot->blockHits, slot->blockHits + 1,
+                   __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Finish a read started by getBlock() or prefetchBlocks(). An
+ * entry whose read failed is dropped again.
+ */
+static void readDone(CacheShard *sh, int i, int res) {
+  CacheEntry *ce;
+
+  ce = &cacheEntries[i];
+  if (res < 0) {
+    /* unhashed before CB_READING goes, so that no lockless
+       lookup can take the entry for its block any more */
+    cacheUnhash(sh, i);
+    setFlags(ce, 0);
+  } else {
+    setFlags(ce, ce->flags & ~CB_READING);
+    sh->misses++;
+  }
+  __atomic_sub_fetch(&ce->refcnt, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&sh->cond);
+}
+
+
+/*
+ * Get a pointer to the raw contents of a disk block. The block
+ * stays in the cache until it is released with putBlock().
+ */
+int getBlock(EOS32_daddr_t bno, unsigned char **pp) {
+  ThreadSlot *slot;
+  CacheShard *sh;
+  CacheEntry *ce;
+  int i;
+  int res;
+
+  if (diskMap != NULL) {
+    if (bno >= filsys.s_fsize) {
+      return -EIO;
+    }
+    *pp = diskMap + (size_t) bno * BLOCK_SIZE;
+    return 0;
+  }
+  sh = blockShard(bno);
+  slot = getSlot();
+  if (slot != NULL) {
+    i = cacheGetLockless(sh, bno);
+    if (i != -1) {
+      countBlockHit(slot);
+      *pp = cacheData + (size_t) i * BLOCK_SIZE;
+      return 0;
+    }
+  }
+  pthread_mutex_lock(&sh->lock);
+  while (1) {
+    i = cacheLookup(sh, bno);
+    if (i != -1) {
+      ce = &cacheEntries[i];
+      if ((ce->flags & (CB_READING | CB_WRITEBACK)) != 0) {
+        pthread_cond_wait(&sh->cond, &sh->lock);
+        continue;
+      }
+      sh->hits++;
+      break;
+    }
+    i = cacheVictim(sh);
+    if (i == -1) {
+      pthread_mutex_unlock(&sh->lock);
+      return -ENOMEM;
+    }
+    ce = &cacheEntries[i];
+    if (cacheLookup(sh, bno) != -1) {
+      /* entered by someone else while the lock was given up */
+      unclaimEntry(ce, 0);
+      continue;
+    }
+    cacheInsert(sh, i, bno);
+    setFlags(ce, ce->flags | CB_READING);
+    unclaimEntry(ce, 1);
+    pthread_mutex_unlock(&sh->lock);
+    res = readBlock(bno, cacheData + (size_t) i * BLOCK_SIZE);
+    pthread_mutex_lock(&sh->lock);
+    readDone(sh, i, res);
+    if (res < 0) {
+      pthread_mutex_unlock(&sh->lock);
+      return res;
+    }
+    break;
+  }
+  __atomic_add_fetch(&ce->refcnt, 1, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sh->lock);
+  *pp = cacheData + (size_t) i * BLOCK_SIZE;
+  return 0;
+}
+
+
+/*
+ * Make sure that a number of blocks are in the cache, reading
+ * all missing ones with a single batch of reads. Holes (block
+ * number 0) are skipped. With a mapped image the kernel is only
+ * advised that the blocks will be needed soon.
+ */
+void prefetchBlocks(EOS32_daddr_t *bnos, int numBlocks) {
+  BlkReq reqs[MAX_PREFETCH];
+  int slots[MAX_PREFETCH];
+  CacheShard *sh;
+  int n;
+  int i;
+  int j;
+
+  if (numBlocks > MAX_PREFETCH) {
+    numBlocks = MAX_PREFETCH;
+  }
+  if (diskMap != NULL) {
+    for (i = 0; i < numBlocks; i++) {
+      if (bnos[i] != 0 && bnos[i] < filsys.s_fsize) {
+        madvise(diskMap + (size_t) bnos[i] * BLOCK_SIZE -
+                ((uintptr_t) diskMap % BLOCK_SIZE), 2 * BLOCK_SIZE,
+                MADV_WILLNEED);
+      }
+    }
+    return;
+  }
+  n = 0;
+  for (i = 0; i < numBlocks; i++) {
+    if (bnos[i] == 0 || bnos[i] >= filsys.s_fsize) {
+      continue;
+    }
+    for (j = 0; j < n; j++) {
+      if (reqs[j].blockNum == bnos[i]) {
+        break;
+      }
+    }
+    if (j < n) {
+      continue;
+    }
+    sh = blockShard(bnos[i]);
+    pthread_mutex_lock(&sh->lock);
+    if (cacheLookup(sh, bnos[i]) != -1) {
+      pthread_mutex_unlock(&sh->lock);
+      continue;
+    }
+    slots[n] = cacheVictim(sh);
+    if (slots[n] == -1) {
+      pthread_mutex_unlock(&sh->lock);
+      break;
+    }
+    if (cacheLookup(sh, bnos[i]) != -1) {
+      unclaimEntry(&cacheEntries[slots[n]], 0);
+      pthread_mutex_unlock(&sh->lock);
+      continue;
+    }
+    /* others wait for the read, and the entry is not evicted */
+    cacheInsert(sh, slots[n], bnos[i]);
+    setFlags(&cacheEntries[slots[n]],
+             cacheEntries[slots[n]].flags | CB_READING);
+    unclaimEntry(&cacheEntries[slots[n]], 1);
+    pthread_mutex_unlock(&sh->lock);
+    reqs[n].blockNum = bnos[i];
+    reqs[n].buf = cacheData + (size_t) slots[n] * BLOCK_SIZE;
+    n++;
+  }
+  blkReadBatch(&disk, reqs, n);
+  for (i = 0; i < n; i++) {
+    sh = entryShard(slots[i]);
+    pthread_mutex_lock(&sh->lock);
+    readDone(sh, slots[i], reqs[i].res);
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+
+void putBlock(unsigned char *p) {
+  if (diskMap != NULL) {
+    return;
+  }
+  __atomic_sub_fetch(&cacheEntries[entryOf(p)].refcnt, 1,
+                     __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Get a cleared buffer for a disk block whose contents on disk
+ * do not matter, e.g. a block which has just been allocated.
+ */
+int getNewBlock(EOS32_daddr_t bno, unsigned char **pp) {
+  CacheShard *sh;
+  CacheEntry *ce;
+  int i;
+
+  if (diskMap != NULL) {
+    return -EROFS;
+  }
+  sh = blockShard(bno);
+  pthread_mutex_lock(&sh->lock);
+  while (1) {
+    i = cacheLookup(sh, bno);
+    if (i == -1) {
+      i = cacheVictim(sh);
+      if (i == -1) {
+        pthread_mutex_unlock(&sh->lock);
+        return -ENOMEM;
+      }
+      if (cacheLookup(sh, bno) != -1) {
+        unclaimEntry(&cacheEntries[i], 0);
+        continue;
+      }
+      cacheInsert(sh, i, bno);
+      unclaimEntry(&cacheEntries[i], 0);
+    }
+    ce = &cacheEntries[i];
+    if ((ce->flags & (CB_READING | CB_WRITEBACK)) != 0) {
+      pthread_cond_wait(&sh->cond, &sh->lock);
+      continue;
+    }
+    break;
+  }
+  __atomic_add_fetch(&ce->refcnt, 1, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sh->lock);
+  *pp = cacheData + (size_t) i * BLOCK_SIZE;
+  memset(*pp, 0, BLOCK_SIZE);
+  return 0;
+}
+
+
+/*
+ * Mark an entry dirty. Must be called with its shard's lock held.
+ */
+static void markBlockDirty(CacheEntry *ce) {
+  if ((ce->flags & CB_DIRTY) != 0) {
+    return;
+  }
+  setFlags(ce, ce->flags | CB_DIRTY);
+  pthread_mutex_lock(&flushLock);
+  if (numDirty++ == 0) {
+    dirtySince = time(NULL);
+  }
+  if (numDirty + numDelayed >= cacheSize / DIRTY_RATIO) {
+    signalFlusher();
+  }
+  pthread_mutex_unlock(&flushLock);
+}
+
+
+/*
+ * Mark a block which was modified in the cache as dirty, so that
+ * it is written back to the disk later.
+ */
+int writeBlock(unsigned char *p) {
+  CacheShard *sh;
+  int i;
+
+  i = entryOf(p);
+  sh = entryShard(i);
+  pthread_mutex_lock(&sh->lock);
+  markBlockDirty(&cacheEntries[i]);
+  pthread_mutex_unlock(&sh->lock);
+  return 0;
+}
+
+
+/*
+ * Get a cleared buffer for file data which has no disk block yet.
+ * The shards take turns in providing them.
+ */
+int getAnonBlock(unsigned char **pp) {
+  CacheShard *sh;
+  int i;
+
+  sh = &cacheShards[anonShard];
+  anonShard = (anonShard + 1) % numShards;
+  pthread_mutex_lock(&sh->lock);
+  i = cacheVictim(sh);
+  if (i == -1) {
+    pthread_mutex_unlock(&sh->lock);
+    return -ENOMEM;
+  }
+  setFlags(&cacheEntries[i], CB_DELAYED);
+  unclaimEntry(&cacheEntries[i], 0);
+  pthread_mutex_unlock(&sh->lock);
+  pthread_mutex_lock(&flushLock);
+  if (numDelayed++ == 0) {
+    delayedSince = time(NULL);
+  }
+  if (numDirty + numDelayed >= cacheSize / DIRTY_RATIO) {
+    signalFlusher();
+  }
+  pthread_mutex_unlock(&flushLock);
+  *pp = cacheData + (size_t) i * BLOCK_SIZE;
+  memset(*pp, 0, BLOCK_SIZE);
+  return 0;
+}
+
+
+/*
+ * Give back a buffer from getAnonBlock() whose data is not needed.
+ */
+void dropAnonBlock(unsigned char *p) {
+  CacheShard *sh;
+  int i;
+
+  i = entryOf(p);
+  sh = entryShard(i);
+  pthread_mutex_lock(&sh->lock);
+  setFlags(&cacheEntries[i], 0);
+  pthread_mutex_unlock(&sh->lock);
+  pthread_mutex_lock(&flushLock);
+  numDelayed--;
+  pthread_mutex_unlock(&flushLock);
+}
+
+
+/*
+ * Give a buffer from getAnonBlock() the disk block which it is
+ * to be written to. A stale copy of that block in the cache is
+ * dropped. If the buffer is not in the block's shard, its data
+ * moves to an entry there; should the shard have no room, the
+ * data is written through to the disk.
+ */
+void assignBlock(unsigned char *p, EOS32_daddr_t bno) {
+  CacheShard *sh;
+  CacheShard *from;
+  CacheEntry *ce;
+  int i;
+  int j;
+
+  i = entryOf(p);
+  sh = blockShard(bno);
+  pthread_mutex_lock(&sh->lock);
+  while (1) {
+    while ((j = cacheLookup(sh, bno)) != -1) {
+      ce = &cacheEntries[j];
+      if ((ce->flags & (CB_READING | CB_WRITEBACK)) != 0) {
+        pthread_cond_wait(&sh->cond, &sh->lock);
+        continue;
+      }
+      if ((ce->flags & CB_DIRTY) != 0) {
+        pthread_mutex_lock(&flushLock);
+        numDirty--;
+        pthread_mutex_unlock(&flushLock);
+      }
+      cacheUnhash(sh, j);
+      setFlags(ce, 0);
+    }
+    if (entryShard(i) == sh) {
+      j = i;
+      if (claimEntry(&cacheEntries[j])) {
+        break;
+      }
+      /* a stray lockless lookup is about to let go of it; it does
+         not signal that, so yield without holding the lock */
+      pthread_mutex_unlock(&sh->lock);
+      sched_yield();
+      pthread_mutex_lock(&sh->lock);
+      continue;
+    }
+    j = cacheVictim(sh);
+    if (j == -1) {
+      break;
+    }
+    if (cacheLookup(sh, bno) == -1) {
+      memcpy(cacheData + (size_t) j * BLOCK_SIZE, p, BLOCK_SIZE);
+      break;
+    }
+    /* entered by someone else while the lock was given up */
+    unclaimEntry(&cacheEntries[j], 0);
+  }
+  if (j != -1) {
+    setFlags(&cacheEntries[j], 0);
+    __atomic_store_n(&cacheEntries[j].referenced, 1, __ATOMIC_RELAXED);
+    cacheInsert(sh, j, bno);
+    markBlockDirty(&cacheEntries[j]);
+    unclaimEntry(&cacheEntries[j], 0);
+  }
+  pthread_mutex_unlock(&sh->lock);
+  if (j != i) {
+    if (j == -1 && blkWrite(&disk, bno, p) < 0) {
+      warning("cannot write block %u", bno);
+    }
+    from = entryShard(i);
+    pthread_mutex_lock(&from->lock);
+    setFlags(&cacheEntries[i], 0);
+    pthread_mutex_unlock(&from->lock);
+  }
+  pthread_mutex_lock(&flushLock);
+  numDelayed--;
+  pthread_mutex_unlock(&flushLock);
+}
+
+
+/*
+ * Check whether the cache holds a newer version of a block than
+ * the disk, so that the disk must not be read directly. The
+ * shard is looked at without its lock, unless its hash chains
+ * change meanwhile.
+ */
+int isDirty(EOS32_daddr_t bno) {
+  CacheShard *sh;
+  unsigned int seq;
+  int i;
+  int n;
+  int flags;
+
+  sh = blockShard(bno);
+  seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+  if ((seq & 1) == 0) {
+    flags = 0;
+    i = __atomic_load_n(&sh->hash[cacheHashFn(bno)], __ATOMIC_ACQUIRE);
+    for (n = 0; i != -1 && n < shardSize; n++) {
+      if (__atomic_load_n(&cacheEntries[i].bno, __ATOMIC_RELAXED) == bno) {
+        flags = __atomic_load_n(&cacheEntries[i].flags, __ATOMIC_ACQUIRE);
+        break;
+      }
+      i = __atomic_load_n(&cacheEntries[i].hashNext, __ATOMIC_ACQUIRE);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (n < shardSize &&
+        __atomic_load_n(&sh->seq, __ATOMIC_RELAXED) == seq) {
+      return (flags & (CB_DIRTY | CB_WRITEBACK)) != 0;
+    }
+  }
+  pthread_mutex_lock(&sh->lock);
+  i = cacheLookup(sh, bno);
+  flags = i == -1 ? 0 : cacheEntries[i].flags;
+  pthread_mutex_unlock(&sh->lock);
+  return (flags & (CB_DIRTY | CB_WRITEBACK)) != 0;
+}
+
+
+/*
+ * Check whether a block is in the cache (or being read into it).
+ * This is only a hint, so no lock is taken.
+ */
+int isCached(EOS32_daddr_t bno) {
+  CacheShard *sh;
+  int i;
+  int n;
+
+  if (diskMap != NULL) {
+    return 1;
+  }
+  sh = blockShard(bno);
+  i = __atomic_load_n(&sh->hash[cacheHashFn(bno)], __ATOMIC_ACQUIRE);
+  for (n = 0; i != -1 && n < shardSize; n++) {
+    if (__atomic_load_n(&cacheEntries[i].bno, __ATOMIC_RELAXED) == bno) {
+      return 1;
+    }
+    i = __atomic_load_n(&cacheEntries[i].hashNext, __ATOMIC_ACQUIRE);
+  }
+  return 0;
+}
+
+
+/*
+ * Copy a block from the cache, if it is there. Returns 1 if it
+ * was copied, 0 if it must be read from the disk.
+ */
+int copyCached(EOS32_daddr_t bno, unsigned char *buf) {
+  CacheShard *sh;
+  CacheEntry *ce;
+  int i;
+
+  sh = blockShard(bno);
+  i = getSlot() == NULL ? -1 : cacheGetLockless(sh, bno);
+  if (i == -1) {
+    pthread_mutex_lock(&sh->lock);
+    i = cacheLookup(sh, bno);
+    if (i == -1 || (cacheEntries[i].flags & CB_READING) != 0) {
+      pthread_mutex_unlock(&sh->lock);
+      return 0;
+    }
+    ce = &cacheEntries[i];
+    __atomic_add_fetch(&ce->refcnt, 1, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sh->lock);
+  }
+  memcpy(buf, cacheData + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+  __atomic_sub_fetch(&cacheEntries[i].refcnt, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+void showCacheStats(void) {
+  unsigned long hits;
+  unsigned long inodeHits;	/* not shown here */
+  unsigned long misses;
+  unsigned long total;
+  int pinned;
+  int s;
+
+  countLocklessHits(&hits, &inodeHits);
+  misses = 0;
+  pinned = 0;
+  for (s = 0; s < numShards; s++) {
+    hits += cacheShards[s].hits;
+    misses += cacheShards[s].misses;
+    pinned += cacheShards[s].pinned;
+  }
+  total = hits + misses;
+  printf("Block cache: %d blocks (%d pinned), "
+         "%lu hits, %lu misses (%.1f%% hit rate).\n",
+         cacheSize, pinned, hits, misses,
+         total == 0 ? 0.0 : 100.0 * hits / total);
+  if (flushBlocks != 0) {
+    printf("Write-back: %lu blocks in %lu writes.\n",
+           flushBlocks, flushWrites);
+  }
+}
+
+
+/**************************************************************/
+
+/* free block management */
+
+
+/*
+ * On disk, the free blocks form the classic V7 free list: up to
+ * NICFREE addresses in the super block, the first of which names
+ * a block holding the next NICFREE addresses, and so on. When a
+ * file system is mounted for writing, the chain is walked once
+ * and turned into a bitmap, from which blocks are allocated and
+ * to which they are freed. The on-disk list is regenerated from
+ * the bitmap when the file system is synced or unmounted.
+ *
+ * A block is allocated next to a goal block, normally the one
+ * following the previous block of the same file, so that files
+ * stay contiguous. A file which is being appended to reserves a
+ * window of free blocks behind its last block, which no other
+ * file allocates from. Reserved blocks are still free as far as
+ * the super block and the on-disk free list are concerned. So
+ * are the blocks promised to file data whose allocation has been
+ * delayed; they are only counted.
+ */
+
+
+#define SB_NFREE	2024	/* offset of s_nfree in super block */
+#define SB_FREE		2028	/* offset of s_free[] in super block */
+#define SB_TIME		4028	/* offset of s_time in super block */
+
+
+unsigned char *freeMap;		/* one bit per block, set if free */
+unsigned char *resvMap;		/* one bit per block, set if reserved */
+EOS32_daddr_t numReserved;	/* number of reserved blocks */
+EOS32_daddr_t numPromised;	/* number of blocks promised */
+EOS32_daddr_t freeRotor;	/* where to look for a free block */
+int freeListDirty;		/* on-disk free list is out of date */
+
+
+static int blockIsFree(EOS32_daddr_t bno) {
+  return (freeMap[bno >> 3] >> (bno & 7)) & 1;
+}
+
+
+/*
+ * Free blocks which are not reserved, as a bit set over the
+ * eight blocks starting at the multiple of 8 bno.
+ */
+static unsigned int availByte(EOS32_daddr_t bno) {
+  return freeMap[bno >> 3] & ~resvMap[bno >> 3];
+}
+
+
+static int blockIsAvail(EOS32_daddr_t bno) {
+  return (availByte(bno & ~7) >> (bno & 7)) & 1;
+}
+
+
+static void markFree(EOS32_daddr_t bno) {
+  freeMap[bno >> 3] |= 1 << (bno & 7);
+}
+
+
+static void markUsed(EOS32_daddr_t bno) {
+  freeMap[bno >> 3] &= ~(1 << (bno & 7));
+}
+
+
+void buildFreeMap(void) {
+  unsigned char buf[BLOCK_SIZE];
+  unsigned char *p;
+  EOS32_daddr_t list[NICFREE];
+  EOS32_daddr_t numFree;
+  EOS32_daddr_t bno;
+  unsigned int nfree;
+  int i;
+
+  freeMap = calloc((filsys.s_fsize + 7) / 8, 1);
+  resvMap = calloc((filsys.s_fsize + 7) / 8, 1);
+  if (freeMap == NULL || resvMap == NULL) {
+    error("cannot allocate free block map");
+  }
+  if (readBlock(1, buf) < 0) {
+    error("cannot read super block");
+  }
+  p = buf + SB_NFREE;
+  numFree = 0;
+  while (1) {
+    nfree = get4Bytes(p);
+    if (nfree > NICFREE) {
+      error("free list is corrupted");
+    }
+    for (i = 0; i < nfree; i++) {
+      list[i] = get4Bytes(p + 4 + 4 * i);
+    }
+    for (i = nfree - 1; i >= 0; i--) {
+      bno = list[i];
+      if (bno == 0 && i == 0) {
+        /* end of chain */
+        break;
+      }
+      if (bno < 2 + filsys.s_isize || bno >= filsys.s_fsize ||
+          blockIsFree(bno)) {
+        error("bad block %u in free list", bno);
+      }
+      markFree(bno);
+      numFree++;
+    }
+    if (nfree == 0 || list[0] == 0) {
+      break;
+    }
+    /* list[0] is the next block of the chain */
+    if (readBlock(list[0], buf) < 0) {
+      error("cannot read free list block %u", list[0]);
+    }
+    p = buf;
+  }
+  if (numFree != filsys.s_freeblks) {
+    warning("free list holds %u blocks, super block says %u",
+            numFree, filsys.s_freeblks);
+    filsys.s_freeblks = numFree;
+  }
+  freeRotor = 2 + filsys.s_isize;
+  freeListDirty = 0;
+}
+
+
+/*
+ * Find an available block, searching upwards from start and
+ * wrapping around at the end of the file system. If wholeByte
+ * is set, only blocks starting a run of 8 available blocks are
+ * taken. Returns 0 if there is none.
+ */
+static EOS32_daddr_t findAvail(EOS32_daddr_t start, int wholeByte) {
+  EOS32_daddr_t first;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t end;
+  unsigned int avail;
+  int wrapped;
+
+  first = 2 + filsys.s_isize;
+  end = filsys.s_fsize & ~7;
+  bno = start;
+  wrapped = 0;
+  while (!wrapped || bno < start) {
+    if ((bno & 7) == 0 && bno < end) {
+      /* look at a byte of the maps at once */
+      avail = availByte(bno);
+      if (avail == 0xFF || (avail != 0 && !wholeByte)) {
+        return bno + __builtin_ctz(avail);
+      }
+      bno += 8;
+    } else {
+      if (!wholeByte && bno >= first && blockIsAvail(bno)) {
+        return bno;
+      }
+      bno++;
+    }
+    if (bno >= filsys.s_fsize) {
+      bno = first;
+      wrapped = 1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Allocate a disk block, as close after the goal block as
+ * possible. Without a goal, the search starts at a rotor which
+ * is left behind the block found, and prefers the beginning of
+ * a run of free blocks, where a new file has room to grow. The
+ * contents of the block are undefined.
+ */
+int allocBlock(EOS32_daddr_t goal, EOS32_daddr_t *bnop) {
+  EOS32_daddr_t first;
+  EOS32_daddr_t bno;
+
+  if (filsys.s_freeblks <= numReserved + numPromised) {
+    return -ENOSPC;
+  }
+  first = 2 + filsys.s_isize;
+  if (goal >= first && goal < filsys.s_fsize) {
+    bno = findAvail(goal, 0);
+  } else {
+    if (freeRotor < first || freeRotor >= filsys.s_fsize) {
+      freeRotor = first;
+    }
+    bno = findAvail(freeRotor & ~7, 1);
+    if (bno == 0) {
+      bno = findAvail(freeRotor, 0);
+    }
+    freeRotor = bno + 1;
+  }
+  if (bno == 0) {
+    /* cannot happen if the free block count is right */
+    return -ENOSPC;
+  }
+  markUsed(bno);
+  filsys.s_freeblks--;
+  freeListDirty = 1;
+  *bnop = bno;
+  return 0;
+}
+
+
+void freeBlock(EOS32_daddr_t bno) {
+  markFree(bno);
+  filsys.s_freeblks++;
+  freeListDirty = 1;
+}
+
+
+/*
+ * Give the blocks of a preallocation window back.
+ */
+void releasePrealloc(Prealloc *pa) {
+  EOS32_daddr_t i;
+
+  if (pa->count == 0) {
+    /* also when an idle inode is dropped by a shared request */
+    return;
+  }
+  for (i = 0; i < pa->count; i++) {
+    resvMap[(pa->start + i) >> 3] &= ~(1 << ((pa->start + i) & 7));
+  }
+  numReserved -= pa->count;
+  pa->count = 0;
+}
+
+
+/*
+ * Reserve the available blocks directly following bno, up to
+ * PREALLOC_BLOCKS of them, replacing the previous window.
+ */
+static void reserveAfter(Prealloc *pa, EOS32_daddr_t bno) {
+  releasePrealloc(pa);
+  pa->start = bno + 1;
+  while (pa->count < PREALLOC_BLOCKS &&
+         pa->start + pa->count < filsys.s_fsize &&
+         filsys.s_freeblks > numReserved + numPromised + 1 &&
+         blockIsAvail(pa->start + pa->count)) {
+    resvMap[(pa->start + pa->count) >> 3] |=
+      1 << ((pa->start + pa->count) & 7);
+    pa->count++;
+    numReserved++;
+  }
+}
+
+
+/*
+ * Allocate a block for a file at the goal *goalp, taking it from
+ * the file's preallocation window if that starts there. If pa is
+ * not NULL, a new window is reserved behind the block when the
+ * old one is used up or does not fit. Advances the goal.
+ */
+int allocFileBlock(Prealloc *pa, EOS32_daddr_t *goalp,
+                   EOS32_daddr_t *bnop) {
+  EOS32_daddr_t bno;
+  int res;
+
+  if (pa != NULL && pa->count > 0 && pa->start == *goalp) {
+    bno = pa->start;
+    resvMap[bno >> 3] &= ~(1 << (bno & 7));
+    numReserved--;
+    pa->start++;
+    pa->count--;
+    markUsed(bno);
+    filsys.s_freeblks--;
+    freeListDirty = 1;
+  } else {
+    res = allocBlock(*goalp, &bno);
+    if (res < 0) {
+      return res;
+    }
+    if (pa != NULL) {
+      reserveAfter(pa, bno);
+    }
+  }
+  *goalp = bno + 1;
+  *bnop = bno;
+  return 0;
+}
+
+
+/*
+ * Allocate a run of up to want contiguous blocks: the first run
+ * of that many available blocks at or behind the goal block, or
+ * the longest run among the first RUN_TRIES ones if there is
+ * none. Without a goal, the search starts at the rotor. Returns
+ * the number of blocks allocated.
+ */
+int allocRun(EOS32_daddr_t goal, EOS32_daddr_t want,
+             EOS32_daddr_t *startp) {
+  EOS32_daddr_t first;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t len;
+  EOS32_daddr_t best;
+  EOS32_daddr_t bestLen;
+  int tries;
+
+  if (filsys.s_freeblks <= numReserved + numPromised) {
+    return -ENOSPC;
+  }
+  if (want > filsys.s_freeblks - numReserved - numPromised) {
+    want = filsys.s_freeblks - numReserved - numPromised;
+  }
+  first = 2 + filsys.s_isize;
+  if (goal < first || goal >= filsys.s_fsize) {
+    if (freeRotor < first || freeRotor >= filsys.s_fsize) {
+      freeRotor = first;
+    }
+    goal = freeRotor;
+  }
+  best = 0;
+  bestLen = 0;
+  bno = findAvail(goal, 0);
+  for (tries = 0; bno != 0 && tries < RUN_TRIES; tries++) {
+    len = 1;
+    while (len < want && bno + len < filsys.s_fsize &&
+           blockIsAvail(bno + len)) {
+      len++;
+    }
+    if (len > bestLen) {
+      best = bno;
+      bestLen = len;
+    }
+    if (len == want) {
+      break;
+    }
+    bno += len;
+    bno = findAvail(bno < filsys.s_fsize ? bno : first, 0);
+  }
+  if (bestLen == 0) {
+    /* cannot happen if the free block count is right */
+    return -ENOSPC;
+  }
+  for (len = 0; len < bestLen; len++) {
+    markUsed(best + len);
+  }
+  filsys.s_freeblks -= bestLen;
+  freeListDirty = 1;
+  freeRotor = best + bestLen;
+  *startp = best;
+  return bestLen;
+}
+
+
+/*
+ * Regenerate the on-disk free list from the free block map, in
+ * the order mkfs uses: the lowest free blocks end up in the super
+ * block, blocks further up are reached through the chain.
+ */
+int writeFreeList(void) {
+  EOS32_daddr_t list[NICFREE];
+  unsigned int nfree;
+  EOS32_daddr_t bno;
+  unsigned char *buf;
+  int res;
+  int i;
+
+  if (!freeListDirty) {
+    return 0;
+  }
+  nfree = 0;
+  list[nfree++] = 0;
+  for (bno = filsys.s_fsize - 1; bno >= 2 + filsys.s_isize; bno--) {
+    if (!blockIsFree(bno)) {
+      continue;
+    }
+    if (nfree == NICFREE) {
+      /* the list goes into the block, which becomes the link */
+      res = getNewBlock(bno, &buf);
+      if (res < 0) {
+        return res;
+      }
+      put4Bytes(buf, nfree);
+      for (i = 0; i < NICFREE; i++) {
+        put4Bytes(buf + 4 + 4 * i, list[i]);
+      }
+      res = writeBlock(buf);
+      putBlock(buf);
+      if (res < 0) {
+        return res;
+      }
+      nfree = 0;
+    }
+    list[nfree++] = bno;
+  }
+  res = getBlock(1, &buf);
+  if (res < 0) {
+    return res;
+  }
+  put4Bytes(buf + 12, filsys.s_freeblks);
+  put4Bytes(buf + SB_NFREE, nfree);
+  for (i = 0; i < NICFREE; i++) {
+    put4Bytes(buf + SB_FREE + 4 * i, i < nfree ? list[i] : 0);
+  }
+  put4Bytes(buf + SB_TIME, time(NULL));
+  res = writeBlock(buf);
+  putBlock(buf);
+  if (res == 0) {
+    freeListDirty = 0;
+  }
+  return res;
+}
+
+
+/**************************************************************/
+
+/* inode handling */
+
+
+static int readInode(EOS32_ino_t ino, Inode *ip) {
+  unsigned char *buf;
+  unsigned char *p;
+  int res;
+  int i;
+
+  if (ino == 0 || ino >= filsys.s_isize * NIPB) {
+    return -ENOENT;
+  }
+  res = getBlock(itod(ino), &buf);
+  if (res < 0) {
+    return res;
+  }
+  p = buf + itoo(ino) * INODE_SIZE;
+  ip->i_number = ino;
+  ip->i_mode = get4Bytes(p + 0);
+  ip->i_nlink = get4Bytes(p + 4);
+  ip->i_uid = get4Bytes(p + 8);
+  ip->i_gid = get4Bytes(p + 12);
+  ip->i_ctime = get4Bytes(p + 16);
+  ip->i_mtime = get4Bytes(p + 20);
+  ip->i_atime = get4Bytes(p + 24);
+  ip->i_size = get4Bytes(p + 28);
+  for (i = 0; i < NADDR; i++) {
+    ip->i_addr[i] = get4Bytes(p + 32 + 4 * i);
+  }
+  putBlock(buf);
+  if ((ip->i_mode & IFMT) == IFFREE) {
+    return -ENOENT;
+  }
+  return 0;
+}
+
+
+static void encodeInode(Inode *ip, unsigned char *p) {
+  int i;
+
+  put4Bytes(p + 0, ip->i_mode);
+  put4Bytes(p + 4, ip->i_nlink);
+  put4Bytes(p + 8, ip->i_uid);
+  put4Bytes(p + 12, ip->i_gid);
+  put4Bytes(p + 16, ip->i_ctime);
+  put4Bytes(p + 20, ip->i_mtime);
+  put4Bytes(p + 24, ip->i_atime);
+  put4Bytes(p + 28, ip->i_size);
+  for (i = 0; i < NADDR; i++) {
+    put4Bytes(p + 32 + 4 * i, ip->i_addr[i]);
+  }
+}
+
+
+/*
+ * Store an inode into its inode block right away.
+ */
+static int storeInode(Inode *ip) {
+  unsigned char *buf;
+  int res;
+
+  res = getBlock(itod(ip->i_number), &buf);
+  if (res < 0) {
+    return res;
+  }
+  encodeInode(ip, buf + itoo(ip->i_number) * INODE_SIZE);
+  res = writeBlock(buf);
+  putBlock(buf);
+  return res;
+}
+
+
+void inodeToStat(Inode *ip, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ip->i_number;
+  switch (ip->i_mode & IFMT) {
+    case IFREG:
+      st->st_mode = S_IFREG;
+      break;
+    case IFDIR:
+      st->st_mode = S_IFDIR;
+      break;
+    case IFCHR:
+      st->st_mode = S_IFCHR;
+      st->st_rdev = makedev(ip->i_addr[0] >> 16, ip->i_addr[0] & 0xFFFF);
+      break;
+    case IFBLK:
+      st->st_mode = S_IFBLK;
+      st->st_rdev = makedev(ip->i_addr[0] >> 16, ip->i_addr[0] & 0xFFFF);
+      break;
+  }
+  /* the permission bits coincide with those of the host */
+  st->st_mode |= ip->i_mode & (ISUID | ISGID | ISVTX | 0777);
+  st->st_nlink = ip->i_nlink;
+  st->st_uid = ip->i_uid;
+  st->st_gid = ip->i_gid;
+  if ((ip->i_mode & IFMT) == IFREG || (ip->i_mode & IFMT) == IFDIR) {
+    st->st_size = ip->i_size;
+    st->st_blocks = ((off_t) ip->i_size + BLOCK_SIZE - 1) /
+                    BLOCK_SIZE * SPB;
+  }
+  st->st_blksize = BLOCK_SIZE;
+  st->st_atime = __atomic_load_n(&ip->i_atime, __ATOMIC_RELAXED);
+  st->st_mtime = ip->i_mtime;
+  st->st_ctime = ip->i_ctime;
+}
+
+
+/*
+ * Map a logical block number within a file to the disk block
+ * which holds it by walking the inode's block tree. A disk block
+ * number of 0 denotes a hole.
+ */
+static int bmapWalk(Inode *ip, EOS32_daddr_t lbn, EOS32_daddr_t *bnop) {
+  unsigned char *buf;
+  EOS32_daddr_t bno;
+  int res;
+
+  if (lbn < NDADDR) {
+    /* direct block */
+    *bnop = ip->i_addr[lbn];
+    return 0;
+  }
+  lbn -= NDADDR;
+  if (lbn < NINDIR) {
+    /* single indirect block */
+    bno = ip->i_addr[SINGLE_INDIR];
+  } else {
+    /* double indirect block */
+    lbn -= NINDIR;
+    if (lbn >= NINDIR * NINDIR) {
+      return -EFBIG;
+    }
+    bno = ip->i_addr[DOUBLE_INDIR];
+    if (bno != 0) {
+      res = getBlock(bno, &buf);
+      if (res < 0) {
+        return res;
+      }
+      bno = get4Bytes(buf + 4 * (lbn / NINDIR));
+      putBlock(buf);
+      lbn %= NINDIR;
+    }
+  }
+  if (bno != 0) {
+    res = getBlock(bno, &buf);
+    if (res < 0) {
+      return res;
+    }
+    bno = get4Bytes(buf + 4 * lbn);
+    putBlock(buf);
+  }
+  *bnop = bno;
+  return 0;
+}
+
+
+/**************************************************************/
+
+/* inode cache */
+
+
+/*
+ * Decoded inodes are kept in a hash table. An inode stays there
+ * as long as the kernel knows it by its node ID, i.e. it has
+ * been returned by a lookup and not yet been forgotten, or as
+ * long as the driver is using it. Inodes which are neither are
+ * put on an idle list, from which the least recently used ones
+ * are released. An inode which has lost its last link is not
+ * put on the idle list, but freed by its last user (see
+ * releaseInode()). Neither is an inode with delayed blocks,
+ * until they have been allocated.
+ *
+ * The table is split into ICACHE_SHARDS shards by inode number,
+ * each with its own lock, hash chains and idle list. The lock
+ * is held while a missing inode is read, so that it is read only
+ * once, and while an inode's reference count changes from or to
+ * zero, which moves it off or onto the idle list. In between,
+ * references are taken and dropped without the lock: an inode
+ * which is referenced already, e.g. because the kernel knows it,
+ * is looked up in its hash chain while the thread is inside an
+ * epoch (see "lockless lookups"), and its count is incremented
+ * unless it is zero. Since
+ * neighbouring inodes go to different shards, a directory's
+ * entries rarely compete for the same lock. Every inode also has
+ * a reader/writer lock of its own, for the few things which
+ * requests change while they share fsLock: its access time and
+ * the name index and filter of a directory. The access time is
+ * read without it.
+ *
+ * writeInode() only puts a modified inode on a dirty list. The
+ * flusher, fsync and unmounting store all of them with one pass
+ * over their inode blocks (64 inodes each), so that a block whose
+ * inodes are changed over and over, e.g. while an archive is
+ * unpacked, is updated once per flush and not once per change.
+ * An inode which leaves the cache is stored then. Allocating and
+ * freeing an inode store it at once, because the inode allocator
+ * looks at the types of inodes in their blocks. The dirty list
+ * is guarded by flushLock.
+ *
+ * Changes of time stamps alone can be recorded with writeTimes()
+ * instead (lazytime). Such an inode is stored only together with
+ * a modified inode of the same block, on sync, or when the oldest
+ * of these changes is LAZY_EXPIRE seconds old.
+ */
+
+
+#define ICACHE_HASH	4096	/* buckets in inode hash table */
+#define ICACHE_IDLE	1024	/* idle inodes kept */
+#define ICACHE_SHARDS	16	/* number of inode cache shards */
+#define LAZY_EXPIRE	(12 * 60 * 60)	/* seconds time stamps may wait */
+
+#define DIRTY_TIMES	0x01	/* time stamps changed */
+#define DIRTY_INODE	0x02	/* other fields changed */
+
+
+typedef struct {
+  pthread_mutex_t lock;		/* guards the shard's inodes */
+  Inode *hash[ICACHE_HASH / ICACHE_SHARDS];
+  Inode *idleHead;		/* least recently used idle inode */
+  Inode *idleTail;		/* most recently used idle inode */
+  Inode *evicted;		/* freed, but still to be stored */
+  Inode *storing;		/* freed, being stored */
+  pthread_cond_t cond;		/* signalled when one has been stored */
+  int numInodes;
+  int numIdle;
+  unsigned long hits;
+  unsigned long misses;
+} InodeShard;
+
+
+InodeShard inodeShards[ICACHE_SHARDS];
+unsigned long dirIndexTotal;	/* table entries in all name indexes */
+Inode *dirtyInodes;		/* modified inodes, not yet stored */
+int numDirtyInodes;		/* those with DIRTY_INODE */
+time_t inodesDirtySince;	/* when the oldest of them was modified */
+int numLazyInodes;		/* those with DIRTY_TIMES only */
+time_t lazySince;		/* when the oldest of them was modified */
+unsigned long inodeUpdates;	/* number of calls of writeInode() */
+unsigned long inodeBlockUpdates;	/* number of inode blocks changed */
+
+
+void initInodeCache(void) {
+  int s;
+
+  for (s = 0; s < ICACHE_SHARDS; s++) {
+    pthread_mutex_init(&inodeShards[s].lock, NULL);
+    pthread_cond_init(&inodeShards[s].cond, NULL);
+  }
+}
+
+
+static InodeShard *inodeShard(EOS32_ino_t ino) {
+  return &inodeShards[ino % ICACHE_SHARDS];
+}
+
+
+static Inode **inodeChain(EOS32_ino_t ino) {
+  return &inodeShard(ino)->hash[ino / ICACHE_SHARDS %
+                                (ICACHE_HASH / ICACHE_SHARDS)];
+}
+
+
+static void idleRemove(InodeShard *sh, Inode *ip) {
+  if (ip->i_idlePrev == NULL) {
+    sh->idleHead = ip->i_idleNext;
+  } else {
+    ip->i_idlePrev->i_idleNext = ip->i_idleNext;
+  }
+  if (ip->i_idleNext == NULL) {
+    sh->idleTail = ip->i_idlePrev;
+  } else {
+    ip->i_idleNext->i_idlePrev = ip->i_idlePrev;
+  }
+  sh->numIdle--;
+}
+
+
+void dropDirIndex(Inode *ip) {
+  if (ip->i_dirIndex != NULL) {
+    __atomic_sub_fetch(&dirIndexTotal, ip->i_dirIndex->mask + 1,
+                       __ATOMIC_RELAXED);
+    free(ip->i_dirIndex);
+    ip->i_dirIndex = NULL;
+  }
+}
+
+
+/*
+ * Take an inode off the dirty list. Must be called with flushLock
+ * held.
+ */
+static void dirtyRemove(Inode *ip) {
+  if (ip->i_dirtyPrev == NULL) {
+    dirtyInodes = ip->i_dirtyNext;
+  } else {
+    ip->i_dirtyPrev->i_dirtyNext = ip->i_dirtyNext;
+  }
+  if (ip->i_dirtyNext != NULL) {
+    ip->i_dirtyNext->i_dirtyPrev = ip->i_dirtyPrev;
+  }
+  if (ip->i_dirty & DIRTY_INODE) {
+    numDirtyInodes--;
+  } else {
+    numLazyInodes--;
+  }
+  ip->i_dirty = 0;
+}
+
+
+static void markDirty(Inode *ip, int how) {
+  pthread_mutex_lock(&flushLock);
+  inodeUpdates++;
+  if (ip->i_dirty == 0) {
+    ip->i_dirtyPrev = NULL;
+    ip->i_dirtyNext = dirtyInodes;
+    if (dirtyInodes != NULL) {
+      dirtyInodes->i_dirtyPrev = ip;
+    }
+    dirtyInodes = ip;
+    if (how == DIRTY_TIMES && numLazyInodes++ == 0) {
+      lazySince = time(NULL);
+    }
+  }
+  if (how == DIRTY_INODE && (ip->i_dirty & DIRTY_INODE) == 0) {
+    if (ip->i_dirty != 0) {
+      numLazyInodes--;
+    }
+    if (numDirtyInodes++ == 0) {
+      inodesDirtySince = time(NULL);
+    }
+  }
+  ip->i_dirty |= how;
+  pthread_mutex_unlock(&flushLock);
+}
+
+
+/*
+ * Note that an inode in the cache was modified. It reaches its
+ * inode block with the next flushInodes(), so errors are reported
+ * there.
+ */
+int writeInode(Inode *ip) {
+  markDirty(ip, DIRTY_INODE);
+  return 0;
+}
+
+
+/*
+ * Note that only the time stamps of an inode in the cache were
+ * changed.
+ */
+void writeTimes(Inode *ip) {
+  markDirty(ip, DIRTY_TIMES);
+}
+
+
+/*
+ * Take an inode off the dirty list, if it is there. Returns 1 if
+ * it was.
+ */
+static int dirtyClear(Inode *ip) {
+  int dirty;
+
+  pthread_mutex_lock(&flushLock);
+  dirty = ip->i_dirty != 0;
+  if (dirty) {
+    dirtyRemove(ip);
+  }
+  pthread_mutex_unlock(&flushLock);
+  return dirty;
+}
+
+
+static int compareInodes(const void *p1, const void *p2) {
+  EOS32_ino_t ino1;
+  EOS32_ino_t ino2;
+
+  ino1 = (*(Inode **) p1)->i_number;
+  ino2 = (*(Inode **) p2)->i_number;
+  return ino1 < ino2 ? -1 : ino1 > ino2 ? 1 : 0;
+}
+
+
+/*
+ * Store the modified inodes, each inode block being fetched and
+ * marked dirty once for all of its inodes. Blocks which hold only
+ * changed time stamps are skipped unless all is set. Inodes whose
+ * block cannot be read stay on the dirty list. Must be called
+ * with fsLock held exclusively, so that the inodes on the list
+ * stay in the cache and do not change. Storing into an inode
+ * block as such needs no more than a reference to the block, see
+ * storeEvicted().
+ */
+int flushInodes(int all) {
+  Inode **list;
+  Inode *ip;
+  unsigned char *buf;
+  EOS32_daddr_t bno;
+  int n;
+  int i;
+  int j;
+  int k;
+  int need;
+  int res;
+  int r;
+
+  pthread_mutex_lock(&flushLock);
+  if (numDirtyInodes == 0 && (numLazyInodes == 0 || !all)) {
+    pthread_mutex_unlock(&flushLock);
+    return 0;
+  }
+  list = malloc((numDirtyInodes + numLazyInodes) * sizeof(Inode *));
+  if (list == NULL) {
+    pthread_mutex_unlock(&flushLock);
+    return -ENOMEM;
+  }
+  n = 0;
+  for (ip = dirtyInodes; ip != NULL; ip = ip->i_dirtyNext) {
+    list[n++] = ip;
+  }
+  pthread_mutex_unlock(&flushLock);
+  qsort(list, n, sizeof(Inode *), compareInodes);
+  res = 0;
+  for (i = 0; i < n; i = j) {
+    bno = itod(list[i]->i_number);
+    need = all;
+    for (j = i; j < n && itod(list[j]->i_number) == bno; j++) {
+      need |= list[j]->i_dirty & DIRTY_INODE;
+    }
+    if (!need) {
+      continue;
+    }
+    r = getBlock(bno, &buf);
+    if (r < 0) {
+      res = r;
+      continue;
+    }
+    for (k = i; k < j; k++) {
+      encodeInode(list[k], buf + itoo(list[k]->i_number) * INODE_SIZE);
+      dirtyClear(list[k]);
+    }
+    r = writeBlock(buf);
+    putBlock(buf);
+    if (r < 0) {
+      res = r;
+    }
+    inodeBlockUpdates++;
+  }
+  free(list);
+  return res;
+}
+
+
+/*
+ * Take an inode out of its shard, with the shard's lock held.
+ * A modified inode is not stored here but put on the shard's
+ * evicted list, for storeEvicted() to store it.
+ */
+static void inodeFree(InodeShard *sh, Inode *ip) {
+  Inode **pp;
+
+  releasePrealloc(&ip->i_prealloc);
+  pp = inodeChain(ip->i_number);
+  while (*pp != ip) {
+    pp = &(*pp)->i_hashNext;
+  }
+  /* lockless lookups may still be on their way through it */
+  __atomic_store_n(pp, ip->i_hashNext, __ATOMIC_RELAXED);
+  sh->numInodes--;
+  pthread_rwlock_destroy(&ip->i_lock);
+  free(ip->i_extMap);
+  dropDirIndex(ip);
+  free(ip->i_dirBloom);
+  free(ip->i_delayed);
+  if (dirtyClear(ip)) {
+    ip->i_idleNext = sh->evicted;
+    sh->evicted = ip;
+  } else {
+    retireInode(ip);
+  }
+}
+
+
+/*
+ * Store the inodes on a shard's evicted list and free them. Must
+ * be called with the shard's lock held, which is given up while
+ * an inode is stored, like flushInodes() does it without the
+ * lock. Until then getInode() waits for the inode, so that it does
+ * not read the inode block before the inode has been stored.
+ *
+ * This may run with fsLock held only shared, in several threads
+ * at once, even for inodes in the same block. That is safe: an
+ * evicted inode is out of the hash and nobody else changes it,
+ * each inode is encoded into its own slot of the block, the
+ * reference from getBlock() keeps the flusher from writing the
+ * block out while it is changed, and the block is marked dirty
+ * under its shard's lock. flushInodes(), which stores many slots
+ * of a block, holds fsLock exclusively and so never runs beside.
+ */
+static void storeEvicted(InodeShard *sh) {
+  Inode *ip;
+  Inode **pp;
+
+  while ((ip = sh->evicted) != NULL) {
+    sh->evicted = ip->i_idleNext;
+    ip->i_idleNext = sh->storing;
+    sh->storing = ip;
+    pthread_mutex_unlock(&sh->lock);
+    if (storeInode(ip) < 0) {
+      warning("cannot write inode %u", ip->i_number);
+    }
+    pthread_mutex_lock(&sh->lock);
+    pp = &sh->storing;
+    while (*pp != ip) {
+      pp = &(*pp)->i_idleNext;
+    }
+    *pp = ip->i_idleNext;
+    retireInode(ip);
+    pthread_cond_broadcast(&sh->cond);
+  }
+}
+
+
+/*
+ * Check whether an inode is still to be stored by storeEvicted().
+ */
+static int isEvicted(InodeShard *sh, EOS32_ino_t ino) {
+  Inode *ip;
+
+  for (ip = sh->evicted; ip != NULL; ip = ip->i_idleNext) {
+    if (ip->i_number == ino) {
+      return 1;
+    }
+  }
+  for (ip = sh->storing; ip != NULL; ip = ip->i_idleNext) {
+    if (ip->i_number == ino) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Put an inode which nobody references any longer at the end of
+ * its shard's idle list, releasing the shard's idle inodes beyond
+ * its part of ICACHE_IDLE.
+ */
+static void idleAppend(InodeShard *sh, Inode *ip) {
+  ip->i_idlePrev = sh->idleTail;
+  ip->i_idleNext = NULL;
+  if (sh->idleTail == NULL) {
+    sh->idleHead = ip;
+  } else {
+    sh->idleTail->i_idleNext = ip;
+  }
+  sh->idleTail = ip;
+  sh->numIdle++;
+  while (sh->numIdle > ICACHE_IDLE / ICACHE_SHARDS) {
+    ip = sh->idleHead;
+    idleRemove(sh, ip);
+    inodeFree(sh, ip);
+  }
+}
+
+
+/*
+ * Called when neither the driver nor the kernel refer to an
+ * inode any longer, with its shard's lock held.
+ */
+static void inodeUnused(InodeShard *sh, Inode *ip) {
+  if (ip->i_numDelayed != 0) {
+    /* kept until its data has been given disk blocks */
+    return;
+  }
+  if (ip->i_nlink != 0) {
+    idleAppend(sh, ip);
+  } else
+  if ((ip->i_mode & IFMT) == IFFREE) {
+    /* freed on disk, drop it from the cache */
+    inodeFree(sh, ip);
+  }
+}
+
+
+static Inode *inodeFind(EOS32_ino_t ino) {
+  Inode *ip;
+
+  for (ip = *inodeChain(ino); ip != NULL; ip = ip->i_hashNext) {
+    if (ip->i_number == ino) {
+      break;
+    }
+  }
+  return ip;
+}
+
+
+/*
+ * Get a reference to an inode which is referenced already,
+ * without taking its shard's lock. Returns NULL if the lock must
+ * be taken.
+ */
+static Inode *inodeGetLockless(ThreadSlot *slot, EOS32_ino_t ino) {
+  Inode *ip;
+  unsigned int count;
+
+  enterEpoch(slot);
+  for (ip = __atomic_load_n(inodeChain(ino), __ATOMIC_ACQUIRE);
+       ip != NULL;
+       ip = __atomic_load_n(&ip->i_hashNext, __ATOMIC_ACQUIRE)) {
+    if (ip->i_number == ino) {
+      break;
+    }
+  }
+  if (ip != NULL) {
+    count = __atomic_load_n(&ip->i_count, __ATOMIC_RELAXED);
+    do {
+      if (count == 0) {
+        ip = NULL;
+        break;
+      }
+    } while (!__atomic_compare_exchange_n(&ip->i_count, &count,
+                                          count + 1, 1,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+  }
+  leaveEpoch(slot);
+  if (ip != NULL) {
+    __atomic_store_n(&slot->inodeHits, slot->inodeHits + 1,
+                     __ATOMIC_RELAXED);
+  }
+  return ip;
+}
+
+
+/*
+ * Get a decoded inode. It stays valid until it is released
+ * with putInode().
+ */
+int getInode(EOS32_ino_t ino, Inode **ipp) {
+  ThreadSlot *slot;
+  InodeShard *sh;
+  Inode *ip;
+  int res;
+
+  slot = getSlot();
+  if (slot != NULL) {
+    ip = inodeGetLockless(slot, ino);
+    if (ip != NULL) {
+      *ipp = ip;
+      return 0;
+    }
+  }
+  sh = inodeShard(ino);
+  pthread_mutex_lock(&sh->lock);
+  while ((ip = inodeFind(ino)) == NULL && isEvicted(sh, ino)) {
+    /* its inode block is not up to date yet */
+    pthread_cond_wait(&sh->cond, &sh->lock);
+  }
+  if (ip != NULL) {
+    sh->hits++;
+    if (__atomic_load_n(&ip->i_count, __ATOMIC_RELAXED) == 0 &&
+        ip->i_nlink != 0 && ip->i_numDelayed == 0) {
+      idleRemove(sh, ip);
+    }
+  } else {
+    sh->misses++;
+    ip = malloc(sizeof(Inode));
+    if (ip == NULL) {
+      pthread_mutex_unlock(&sh->lock);
+      return -ENOMEM;
+    }
+    res = readInode(ino, ip);
+    if (res < 0) {
+      pthread_mutex_unlock(&sh->lock);
+      free(ip);
+      return res;
+    }
+    ip->i_count = 0;
+    ip->i_nlookup = 0;
+    ip->i_extMap = NULL;
+    ip->i_dirIndex = NULL;
+    ip->i_dirBloom = NULL;
+    ip->i_lastChild = 0;
+    ip->i_allocGoal = 0;
+    ip->i_prealloc.count = 0;
+    ip->i_writers = 0;
+    ip->i_delayed = NULL;
+    ip->i_numDelayed = 0;
+    ip->i_maxDelayed = 0;
+    ip->i_promised = 0;
+    ip->i_delayNext = NULL;
+    ip->i_dirty = 0;
+    pthread_rwlock_init(&ip->i_lock, NULL);
+    ip->i_hashNext = *inodeChain(ino);
+    __atomic_store_n(inodeChain(ino), ip, __ATOMIC_RELEASE);
+    sh->numInodes++;
+  }
+  __atomic_add_fetch(&ip->i_count, 1, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&sh->lock);
+  *ipp = ip;
+  return 0;
+}
+
+
+void putInode(Inode *ip) {
+  InodeShard *sh;
+  unsigned int count;
+
+  /* only the last reference needs the lock */
+  count = __atomic_load_n(&ip->i_count, __ATOMIC_RELAXED);
+  while (count > 1) {
+    if (__atomic_compare_exchange_n(&ip->i_count, &count, count - 1, 1,
+                                    __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+  sh = inodeShard(ip->i_number);
+  pthread_mutex_lock(&sh->lock);
+  if (__atomic_sub_fetch(&ip->i_count, 1, __ATOMIC_ACQ_REL) == 0) {
+    inodeUnused(sh, ip);
+    storeEvicted(sh);
+  }
+  pthread_mutex_unlock(&sh->lock);
+}
+
+
+/*
+ * Check whether an inode is in the cache. This is only a hint,
+ * the inode may be evicted as soon as the lock is released.
+ */
+int isInodeCached(EOS32_ino_t ino) {
+  InodeShard *sh;
+  int res;
+
+  sh = inodeShard(ino);
+  pthread_mutex_lock(&sh->lock);
+  res = inodeFind(ino) != NULL;
+  pthread_mutex_unlock(&sh->lock);
+  return res;
+}
+
+
+/*
+ * Count references which the kernel gets (delta > 0) or, after
+ * all, does not get (delta < 0) on an inode the caller holds.
+ * While the kernel has any, they count as one in i_count.
+ */
+void addLookups(Inode *ip, int delta) {
+  InodeShard *sh;
+
+  sh = inodeShard(ip->i_number);
+  pthread_mutex_lock(&sh->lock);
+  if (ip->i_nlookup == 0 && delta > 0) {
+    __atomic_add_fetch(&ip->i_count, 1, __ATOMIC_RELAXED);
+  }
+  ip->i_nlookup += delta;
+  if (ip->i_nlookup == 0 && delta < 0) {
+    __atomic_sub_fetch(&ip->i_count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&sh->lock);
+}
+
+
+/*
+ * Drop references which the kernel held on an inode. Returns 1
+ * if the inode has no links and is not referenced any longer,
+ * so that it should be freed.
+ */
+int forgetInode(EOS32_ino_t ino, uint64_t nlookup) {
+  InodeShard *sh;
+  Inode *ip;
+  int res;
+
+  sh = inodeShard(ino);
+  pthread_mutex_lock(&sh->lock);
+  ip = inodeFind(ino);
+  res = 0;
+  if (ip != NULL && ip->i_nlookup != 0) {
+    if (nlookup > ip->i_nlookup) {
+      nlookup = ip->i_nlookup;
+    }
+    ip->i_nlookup -= nlookup;
+    if (ip->i_nlookup == 0 &&
+        __atomic_sub_fetch(&ip->i_count, 1, __ATOMIC_ACQ_REL) == 0) {
+      if (ip->i_nlink == 0) {
+        /* to be freed by the caller */
+        res = 1;
+      } else {
+        inodeUnused(sh, ip);
+        storeEvicted(sh);
+      }
+    }
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return res;
+}
+
+
+/*
+ * Called when the delayed blocks of an inode have all got disk
+ * blocks, which may leave the inode unused.
+ */
+void delayedDone(Inode *ip) {
+  InodeShard *sh;
+
+  sh = inodeShard(ip->i_number);
+  pthread_mutex_lock(&sh->lock);
+  if (__atomic_load_n(&ip->i_count, __ATOMIC_ACQUIRE) == 0) {
+    inodeUnused(sh, ip);
+    storeEvicted(sh);
+  }
+  pthread_mutex_unlock(&sh->lock);
+}
+
+
+/*
+ * Drop the name indexes of idle directories until size more
+ * table entries fit into the budget.
+ */
+static void dropIdleIndexes(unsigned long size) {
+  InodeShard *sh;
+  Inode *ip;
+  int s;
+
+  for (s = 0; s < ICACHE_SHARDS; s++) {
+    sh = &inodeShards[s];
+    pthread_mutex_lock(&sh->lock);
+    for (ip = sh->idleHead;
+         ip != NULL &&
+         __atomic_load_n(&dirIndexTotal, __ATOMIC_RELAXED) + size >
+           DI_BUDGET;
+         ip = ip->i_idleNext) {
+      dropDirIndex(ip);
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+
+void showInodeStats(void) {
+  unsigned long blockHits;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long total;
+  int numInodes;
+  int numIdle;
+  int s;
+
+  countLocklessHits(&blockHits, &hits);
+  misses = 0;
+  numInodes = 0;
+  numIdle = 0;
+  for (s = 0; s < ICACHE_SHARDS; s++) {
+    hits += inodeShards[s].hits;
+    misses += inodeShards[s].misses;
+    numInodes += inodeShards[s].numInodes;
+    numIdle += inodeShards[s].numIdle;
+  }
+  total = hits + misses;
+  printf("Inode cache: %d inodes (%d idle), "
+         "%lu hits, %lu misses (%.1f%% hit rate).\n",
+         numInodes, numIdle, hits, misses,
+         total == 0 ? 0.0 : 100.0 * hits / total);
+  if (inodeUpdates != 0) {
+    printf("Inode updates: %lu, stored with %lu inode block updates.\n",
+           inodeUpdates, inodeBlockUpdates);
+  }
+}
+
+
+/**************************************************************/
+
+/* block mapping */
+
+
+/*
+ * Once a file is accessed beyond its direct blocks, its whole
+ * block tree is condensed into a sorted list of extents, each a
+ * run of logical blocks stored in consecutive disk blocks. Holes
+ * are not listed. Mapping a block is then a binary search, with
+ * no indirect blocks involved. The map is kept with the cached
+ * inode. Allocating a block adds it to the map, truncating a
+ * file drops the map, to be built again when it is needed.
+ */
+
+
+#define EXT_MAX		4096	/* more fragmented files are not mapped */
+
+
+typedef struct {
+  EOS32_daddr_t lbn;		/* first logical block */
+  EOS32_daddr_t bno;		/* first disk block */
+  EOS32_daddr_t len;		/* number of blocks */
+} Extent;
+
+
+typedef struct extMap {
+  int numExt;			/* number of extents, -1 if too many */
+  Extent ext[];
+} ExtMap;
+
+
+static int extAppend(Extent *ext, int *np,
+                     EOS32_daddr_t lbn, EOS32_daddr_t bno) {
+  Extent *last;
+
+  if (bno == 0) {
+    return 0;
+  }
+  if (*np > 0) {
+    last = &ext[*np - 1];
+    if (last->lbn + last->len == lbn && last->bno + last->len == bno) {
+      last->len++;
+      return 0;
+    }
+  }
+  if (*np == EXT_MAX) {
+    return -1;
+  }
+  ext[*np].lbn = lbn;
+  ext[*np].bno = bno;
+  ext[*np].len = 1;
+  (*np)++;
+  return 0;
+}
+
+
+/*
+ * Append the extents described by an indirect block which maps
+ * logical blocks from lbn on, up to (but not including) end.
+ */
+static int extAppendIndir(Extent *ext, int *np, EOS32_daddr_t bno,
+                          EOS32_daddr_t lbn, EOS32_daddr_t end) {
+  unsigned char *buf;
+  int res;
+  int i;
+
+  if (bno == 0) {
+    return 0;
+  }
+  res = getBlock(bno, &buf);
+  if (res < 0) {
+    return res;
+  }
+  for (i = 0; i < NINDIR && lbn + i < end; i++) {
+    if (extAppend(ext, np, lbn + i, get4Bytes(buf + 4 * i)) < 0) {
+      putBlock(buf);
+      return 1;
+    }
+  }
+  putBlock(buf);
+  return 0;
+}
+
+
+/*
+ * Collect the extents of a file. The second level indirect
+ * blocks are fetched in batches before they are walked.
+ * Returns NULL if the block tree cannot be read.
+ */
+static ExtMap *buildExtMap(Inode *ip) {
+  EOS32_daddr_t numBlocks;
+  EOS32_daddr_t bnos[MAX_PREFETCH];
+  EOS32_daddr_t lbn;
+  unsigned char *dbuf;
+  Extent *ext;
+  ExtMap *em;
+  int n;
+  int res;
+  int i;
+  int j;
+
+  ext = malloc(EXT_MAX * sizeof(Extent));
+  if (ext == NULL) {
+    return NULL;
+  }
+  numBlocks = (ip->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  n = 0;
+  res = 0;
+  for (lbn = 0; lbn < NDADDR && lbn < numBlocks; lbn++) {
+    extAppend(ext, &n, lbn, ip->i_addr[lbn]);
+  }
+  if (numBlocks > NDADDR) {
+    res = extAppendIndir(ext, &n, ip->i_addr[SINGLE_INDIR],
+                         NDADDR, numBlocks);
+  }
+  lbn = NDADDR + NINDIR;
+  if (res == 0 && numBlocks > lbn && ip->i_addr[DOUBLE_INDIR] != 0) {
+    res = getBlock(ip->i_addr[DOUBLE_INDIR], &dbuf);
+    if (res < 0) {
+      free(ext);
+      return NULL;
+    }
+    for (i = 0; res == 0 && i < NINDIR && lbn < numBlocks;
+         i += MAX_PREFETCH) {
+      for (j = 0; j < MAX_PREFETCH && i + j < NINDIR; j++) {
+        bnos[j] = get4Bytes(dbuf + 4 * (i + j));
+      }
+      prefetchBlocks(bnos, j);
+      for (j = 0; res == 0 && j < MAX_PREFETCH && i + j < NINDIR &&
+                  lbn < numBlocks; j++) {
+        res = extAppendIndir(ext, &n, bnos[j], lbn, numBlocks);
+        lbn += NINDIR;
+      }
+    }
+    putBlock(dbuf);
+  }
+  if (res < 0) {
+    free(ext);
+    return NULL;
+  }
+  if (res > 0) {
+    /* too fragmented, keep an empty map to remember that */
+    n = 0;
+  }
+  em = malloc(sizeof(ExtMap) + n * sizeof(Extent));
+  if (em != NULL) {
+    em->numExt = res > 0 ? -1 : n;
+    memcpy(em->ext, ext, n * sizeof(Extent));
+  }
+  free(ext);
+  return em;
+}
+
+
+/*
+ * Get the extent map of a file, building it if necessary. Two
+ * readers may build it at the same time; the first one to be
+ * done installs its map, the other one uses that instead.
+ */
+static ExtMap *getExtMap(Inode *ip) {
+  ExtMap *em;
+  ExtMap *none;
+
+  em = __atomic_load_n(&ip->i_extMap, __ATOMIC_ACQUIRE);
+  if (em == NULL) {
+    em = buildExtMap(ip);
+    none = NULL;
+    if (em != NULL &&
+        !__atomic_compare_exchange_n(&ip->i_extMap, &none, em, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      free(em);
+      em = none;
+    }
+  }
+  return em;
+}
+
+
+/*
+ * Record a newly allocated block in the extent map of a file,
+ * if it has one.
+ */
+static void extMapAdd(Inode *ip, EOS32_daddr_t lbn, EOS32_daddr_t bno) {
+  ExtMap *em;
+  ExtMap *bigger;
+  Extent *prev;
+  int i;
+
+  em = ip->i_extMap;
+  if (em == NULL || em->numExt < 0) {
+    return;
+  }
+  /* find the first extent after lbn */
+  for (i = em->numExt; i > 0 && em->ext[i - 1].lbn > lbn; i--) ;
+  if (i > 0) {
+    prev = &em->ext[i - 1];
+    if (prev->lbn + prev->len == lbn && prev->bno + prev->len == bno &&
+        (i == em->numExt || em->ext[i].lbn > lbn)) {
+      prev->len++;
+      return;
+    }
+  }
+  if (em->numExt == EXT_MAX) {
+    em->numExt = -1;
+    return;
+  }
+  bigger = realloc(em, sizeof(ExtMap) + (em->numExt + 1) * sizeof(Extent));
+  if (bigger == NULL) {
+    free(em);
+    ip->i_extMap = NULL;
+    return;
+  }
+  em = bigger;
+  ip->i_extMap = em;
+  memmove(&em->ext[i + 1], &em->ext[i],
+          (em->numExt - i) * sizeof(Extent));
+  em->ext[i].lbn = lbn;
+  em->ext[i].bno = bno;
+  em->ext[i].len = 1;
+  em->numExt++;
+}
+
+
+static void dropExtMap(Inode *ip) {
+  free(ip->i_extMap);
+  ip->i_extMap = NULL;
+}
+
+
+static EOS32_daddr_t extSearch(ExtMap *em, EOS32_daddr_t lbn) {
+  int lo;
+  int hi;
+  int mid;
+
+  /* find the last extent starting at or before lbn */
+  lo = 0;
+  hi = em->numExt;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (em->ext[mid].lbn <= lbn) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  if (hi == 0 || lbn < em->ext[lo].lbn ||
+      lbn >= em->ext[lo].lbn + em->ext[lo].len) {
+    return 0;
+  }
+  return em->ext[lo].bno + (lbn - em->ext[lo].lbn);
+}
+
+
+/*
+ * Map a logical block number within a file to the disk block
+ * which holds it. A disk block number of 0 denotes a hole.
+ */
+int bmap(Inode *ip, EOS32_daddr_t lbn, EOS32_daddr_t *bnop) {
+  ExtMap *em;
+
+  if (lbn < NDADDR) {
+    *bnop = ip->i_addr[lbn];
+    return 0;
+  }
+  if (lbn >= NDADDR + NINDIR + NINDIR * NINDIR) {
+    return -EFBIG;
+  }
+  em = getExtMap(ip);
+  if (em == NULL || em->numExt < 0) {
+    return bmapWalk(ip, lbn, bnop);
+  }
+  *bnop = extSearch(em, lbn);
+  return 0;
+}
+
+
+/*
+ * Count the blocks from lbn on which continue the mapping of
+ * lbn to bno in an extent map: the rest of bno's extent, or, if
+ * bno is 0, the hole up to the next extent.
+ */
+static EOS32_daddr_t extRun(ExtMap *em, EOS32_daddr_t lbn,
+                            EOS32_daddr_t bno) {
+  int lo;
+  int hi;
+  int mid;
+
+  /* find the first extent ending after lbn */
+  lo = 0;
+  hi = em->numExt;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (em->ext[mid].lbn + em->ext[mid].len <= lbn) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == em->numExt) {
+    return bno == 0 ? NDADDR + NINDIR + NINDIR * NINDIR - lbn : 0;
+  }
+  if (lbn < em->ext[lo].lbn) {
+    return bno == 0 ? em->ext[lo].lbn - lbn : 0;
+  }
+  if (bno != em->ext[lo].bno + (lbn - em->ext[lo].lbn)) {
+    return 0;
+  }
+  return em->ext[lo].lbn + em->ext[lo].len - lbn;
+}
+
+
+/*
+ * Count the blocks from lbn on which are holes because the
+ * indirect block which would map them is missing. Returns 0 if
+ * there is such an indirect block.
+ */
+static EOS32_daddr_t indirHole(Inode *ip, EOS32_daddr_t lbn) {
+  unsigned char *buf;
+  EOS32_daddr_t bno;
+
+  if (lbn < NDADDR) {
+    return 0;
+  }
+  lbn -= NDADDR;
+  if (lbn < NINDIR) {
+    return ip->i_addr[SINGLE_INDIR] == 0 ? NINDIR - lbn : 0;
+  }
+  lbn -= NINDIR;
+  if (lbn >= NINDIR * NINDIR) {
+    return 0;
+  }
+  if (ip->i_addr[DOUBLE_INDIR] == 0) {
+    return NINDIR * NINDIR - lbn;
+  }
+  if (getBlock(ip->i_addr[DOUBLE_INDIR], &buf) < 0) {
+    return 0;
+  }
+  bno = get4Bytes(buf + 4 * (lbn / NINDIR));
+  putBlock(buf);
+  return bno == 0 ? NINDIR - lbn % NINDIR : 0;
+}
+
+
+/*
+ * Like bmap(), but also count how many blocks from lbn on (at
+ * least 1, at most max) continue the mapping: disk blocks which
+ * follow the first one, or, if lbn is in a hole, more holes. A
+ * hole left by a missing indirect block is skipped as a whole,
+ * i.e. 4 MiB (or 4 GiB for the double indirect block) at once.
+ */
+int bmapRun(Inode *ip, EOS32_daddr_t lbn, EOS32_daddr_t max,
+            EOS32_daddr_t *bnop, EOS32_daddr_t *countp) {
+  ExtMap *em;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t next;
+  EOS32_daddr_t mapped;
+  EOS32_daddr_t count;
+  EOS32_daddr_t span;
+  int res;
+
+  res = bmap(ip, lbn, &bno);
+  if (res < 0) {
+    return res;
+  }
+  count = 1;
+  while (count < max) {
+    next = bno == 0 ? 0 : bno + count;
+    if (lbn + count >= NDADDR) {
+      em = __atomic_load_n(&ip->i_extMap, __ATOMIC_ACQUIRE);
+      if (em != NULL && em->numExt >= 0) {
+        count += extRun(em, lbn + count, next);
+        break;
+      }
+    }
+    if (bno == 0) {
+      span = indirHole(ip, lbn + count);
+      if (span != 0) {
+        count += span;
+        continue;
+      }
+    }
+    if (bmap(ip, lbn + count, &mapped) < 0 || mapped != next) {
+      break;
+    }
+    count++;
+  }
+  *bnop = bno;
+  *countp = count < max ? count : max;
+  return 0;
+}
+
+
+/*
+ * Get the indirect block *ibnop, allocating a cleared one first
+ * if there is none.
+ */
+static int getIndir(EOS32_daddr_t *ibnop, Prealloc *pa,
+                    EOS32_daddr_t *goalp, unsigned char **pp) {
+  EOS32_daddr_t ibno;
+  int res;
+
+  if (*ibnop != 0) {
+    return getBlock(*ibnop, pp);
+  }
+  res = allocFileBlock(pa, goalp, &ibno);
+  if (res < 0) {
+    return res;
+  }
+  res = getNewBlock(ibno, pp);
+  if (res == 0) {
+    res = writeBlock(*pp);
+    if (res < 0) {
+      putBlock(*pp);
+    }
+  }
+  if (res < 0) {
+    freeBlock(ibno);
+    return res;
+  }
+  *ibnop = ibno;
+  return 0;
+}
+
+
+/*
+ * Find where a new block for logical block lbn of a file should
+ * go: behind the block preceding it in the file, or near the
+ * file's directory if there is none. Returns 0 if there is no
+ * preference.
+ */
+static EOS32_daddr_t fileGoal(Inode *ip, EOS32_daddr_t lbn) {
+  EOS32_daddr_t bno;
+
+  if (lbn > 0 && bmap(ip, lbn - 1, &bno) == 0 && bno != 0) {
+    return bno + 1;
+  }
+  if (ip->i_allocGoal != 0) {
+    /* start at a run of free blocks near the file's directory */
+    return findAvail(ip->i_allocGoal & ~7, 1);
+  }
+  return 0;
+}
+
+
+/*
+ * Enter disk block bno as logical block lbn of a file, which is
+ * a hole. Missing indirect blocks are allocated at the goal
+ * *goalp, from the preallocation window pa (which may be NULL).
+ * The caller must write the inode, whose block addresses may
+ * have changed, even if an error is returned.
+ */
+static int bmapSet(Inode *ip, EOS32_daddr_t lbn, EOS32_daddr_t bno,
+                   Prealloc *pa, EOS32_daddr_t *goalp) {
+  unsigned char *dbuf;
+  unsigned char *ibuf;
+  EOS32_daddr_t ibno;
+  EOS32_daddr_t n;
+  int res;
+
+  n = lbn;
+  if (n < NDADDR) {
+    /* direct block */
+    ip->i_addr[n] = bno;
+  } else {
+    n -= NDADDR;
+    if (n < NINDIR) {
+      /* single indirect block */
+      res = getIndir(&ip->i_addr[SINGLE_INDIR], pa, goalp, &ibuf);
+      if (res < 0) {
+        return res;
+      }
+    } else {
+      /* double indirect block */
+      n -= NINDIR;
+      res = getIndir(&ip->i_addr[DOUBLE_INDIR], pa, goalp, &dbuf);
+      if (res < 0) {
+        return res;
+      }
+      ibno = get4Bytes(dbuf + 4 * (n / NINDIR));
+      res = getIndir(&ibno, pa, goalp, &ibuf);
+      if (res == 0 && get4Bytes(dbuf + 4 * (n / NINDIR)) == 0) {
+        put4Bytes(dbuf + 4 * (n / NINDIR), ibno);
+        res = writeBlock(dbuf);
+        if (res < 0) {
+          putBlock(ibuf);
+          freeBlock(ibno);
+        }
+      }
+      putBlock(dbuf);
+      if (res < 0) {
+        return res;
+      }
+      n %= NINDIR;
+    }
+    put4Bytes(ibuf + 4 * n, bno);
+    res = writeBlock(ibuf);
+    putBlock(ibuf);
+    if (res < 0) {
+      return res;
+    }
+  }
+  extMapAdd(ip, lbn, bno);
+  return 0;
+}
+
+
+/*
+ * Like bmap(), but allocate a disk block (and the indirect blocks
+ * leading to it) if logical block lbn is a hole. A file being
+ * appended to gets a preallocation window in pa (which may be
+ * NULL). Returns 1 if the block is new, so that its contents are
+ * undefined. The caller must write the inode, whose block
+ * addresses may have changed, even if an error is returned.
+ */
+int bmapAlloc(Inode *ip, EOS32_daddr_t lbn, Prealloc *pa,
+              EOS32_daddr_t *bnop) {
+  EOS32_daddr_t bno;
+  EOS32_daddr_t goal;
+  int res;
+
+  res = bmap(ip, lbn, &bno);
+  if (res < 0) {
+    return res;
+  }
+  if (bno != 0) {
+    *bnop = bno;
+    return 0;
+  }
+  goal = fileGoal(ip, lbn);
+  if ((off_t) lbn * BLOCK_SIZE < ip->i_size) {
+    /* filling a hole, not appending */
+    pa = NULL;
+  }
+  res = allocFileBlock(pa, &goal, &bno);
+  if (res < 0) {
+    return res;
+  }
+  res = bmapSet(ip, lbn, bno, pa, &goal);
+  if (res < 0) {
+    freeBlock(bno);
+    return res;
+  }
+  *bnop = bno;
+  return 1;
+}
+
+
+/*
+ * Free what the indirect block *bnop maps from logical block from
+ * (relative to the block's span) on. At level 1 the entries are
+ * data blocks, at level 2 single indirect blocks. If from is 0,
+ * the indirect block itself is freed and *bnop is cleared.
+ */
+static int truncIndir(EOS32_daddr_t *bnop, EOS32_daddr_t from, int level) {
+  unsigned char *buf;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t span;
+  int modified;
+  int res;
+  int i;
+
+  if (*bnop == 0) {
+    return 0;
+  }
+  res = getBlock(*bnop, &buf);
+  if (res < 0) {
+    return res;
+  }
+  span = level == 1 ? 1 : NINDIR;
+  modified = 0;
+  for (i = from / span; i < NINDIR; i++) {
+    bno = get4Bytes(buf + 4 * i);
+    if (bno == 0) {
+      continue;
+    }
+    if (level == 1) {
+      freeBlock(bno);
+      bno = 0;
+    } else {
+      res = truncIndir(&bno, i == from / span ? from % span : 0, 1);
+      if (res < 0) {
+        break;
+      }
+    }
+    if (bno == 0) {
+      put4Bytes(buf + 4 * i, 0);
+      modified = 1;
+    }
+  }
+  if (res == 0 && from == 0) {
+    putBlock(buf);
+    freeBlock(*bnop);
+    *bnop = 0;
+    return 0;
+  }
+  if (modified && writeBlock(buf) < 0 && res == 0) {
+    res = -EIO;
+  }
+  putBlock(buf);
+  return res;
+}
+
+
+/*
+ * Change the size of a file. Blocks beyond a new, smaller size
+ * are freed, and the rest of its last block is cleared so that
+ * a later extension reads as zeros. The caller must write the
+ * inode.
+ */
+int truncInode(Inode *ip, EOS32_off_t size) {
+  EOS32_daddr_t first;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  unsigned char *buf;
+  int res;
+
+  if (size > ip->i_size) {
+    ip->i_size = size;
+    return 0;
+  }
+  if (size % BLOCK_SIZE != 0) {
+    res = bmap(ip, size / BLOCK_SIZE, &bno);
+    if (res == 0 && bno != 0) {
+      res = getBlock(bno, &buf);
+      if (res == 0) {
+        memset(buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        res = writeBlock(buf);
+        putBlock(buf);
+      }
+    }
+    if (res < 0) {
+      return res;
+    }
+  }
+  first = ((off_t) size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (lbn = first; lbn < NDADDR; lbn++) {
+    if (ip->i_addr[lbn] != 0) {
+      freeBlock(ip->i_addr[lbn]);
+      ip->i_addr[lbn] = 0;
+    }
+  }
+  res = 0;
+  if (first < NDADDR + NINDIR) {
+    res = truncIndir(&ip->i_addr[SINGLE_INDIR],
+                     first > NDADDR ? first - NDADDR : 0, 1);
+  }
+  if (res == 0) {
+    res = truncIndir(&ip->i_addr[DOUBLE_INDIR],
+                     first > NDADDR + NINDIR ?
+                       first - NDADDR - NINDIR : 0, 2);
+  }
+  ip->i_size = size;
+  dropExtMap(ip);
+  return res;
+}
+
+
+/*
+ * Bring the disk blocks holding count logical blocks of a file,
+ * starting at lbn, into the cache with one batch of reads.
+ */
+void prefetchFileBlocks(Inode *ip, EOS32_daddr_t lbn, int count) {
+  EOS32_daddr_t bnos[MAX_PREFETCH];
+  int i;
+
+  if (count > MAX_PREFETCH) {
+    count = MAX_PREFETCH;
+  }
+  for (i = 0; i < count; i++) {
+    if (bmap(ip, lbn + i, &bnos[i]) < 0) {
+      break;
+    }
+  }
+  prefetchBlocks(bnos, i);
+}
+
+
+/**************************************************************/
+
+/* delayed allocation */
+
+
+/*
+ * Data written to a hole or beyond the end of a file gets no disk
+ * block at first. It stays in the block cache, listed in the
+ * inode by logical block number, and enough free blocks for it
+ * and for the indirect blocks it may need are promised. When the
+ * flusher runs, on fsync, or when too much such data has piled
+ * up, every run of consecutive logical blocks is given a run of
+ * contiguous disk blocks in one go, so that a file written in
+ * small pieces still ends up in few extents.
+ */
+
+
+Inode *delayedInodes;		/* inodes with delayed blocks */
+
+
+/*
+ * Find the delayed block for logical block lbn of a file. Returns
+ * its index in i_delayed, or -1 - the index where it belongs.
+ */
+static int findDelayed(Inode *ip, EOS32_daddr_t lbn) {
+  int lo;
+  int hi;
+  int mid;
+
+  lo = 0;
+  hi = ip->i_numDelayed;
+  if (hi > 0 && ip->i_delayed[hi - 1].lbn < lbn) {
+    /* appending */
+    return -1 - hi;
+  }
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (ip->i_delayed[mid].lbn < lbn) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < ip->i_numDelayed && ip->i_delayed[lo].lbn == lbn) {
+    return lo;
+  }
+  return -1 - lo;
+}
+
+
+static int sameIndir(EOS32_daddr_t lbn1, EOS32_daddr_t lbn2) {
+  return lbn1 >= NDADDR && lbn2 >= NDADDR &&
+         (lbn1 - NDADDR) / NINDIR == (lbn2 - NDADDR) / NINDIR;
+}
+
+
+/*
+ * Count the blocks which the delayed blocks of a file may need:
+ * one each, and one for every indirect block leading to them,
+ * whether it exists already or not.
+ */
+static EOS32_daddr_t delayPromise(Inode *ip) {
+  DelayedBlock *db;
+  EOS32_daddr_t total;
+  unsigned int i;
+
+  db = ip->i_delayed;
+  total = 0;
+  for (i = 0; i < ip->i_numDelayed; i++) {
+    total++;
+    if (db[i].lbn >= NDADDR &&
+        (i == 0 || !sameIndir(db[i - 1].lbn, db[i].lbn))) {
+      total++;
+    }
+    if (db[i].lbn >= NDADDR + NINDIR &&
+        (i == 0 || db[i - 1].lbn < NDADDR + NINDIR)) {
+      total++;
+    }
+  }
+  return total;
+}
+
+
+static void setPromise(Inode *ip, EOS32_daddr_t promised) {
+  numPromised -= ip->i_promised;
+  ip->i_promised = promised;
+  numPromised += promised;
+}
+
+
+static void unlinkDelayed(Inode *ip) {
+  Inode **pp;
+
+  pp = &delayedInodes;
+  while (*pp != ip) {
+    pp = &(*pp)->i_delayNext;
+  }
+  *pp = ip->i_delayNext;
+  ip->i_delayNext = NULL;
+}
+
+
+/*
+ * Give the delayed blocks of a file disk blocks, and enter them
+ * into its block tree. If the file is open for writing and the
+ * last run ends at the end of the file, a preallocation window
+ * is reserved behind it, so that the next run can follow there.
+ */
+int allocDelayed(Inode *ip) {
+  DelayedBlock *db;
+  Prealloc *pa;
+  EOS32_daddr_t goal;
+  EOS32_daddr_t start;
+  unsigned int done;
+  unsigned int n;
+  unsigned int i;
+  int got;
+  int res;
+
+  db = ip->i_delayed;
+  n = ip->i_numDelayed;
+  pa = ip->i_writers != 0 ? &ip->i_prealloc : NULL;
+  setPromise(ip, 0);
+  res = 0;
+  goal = 0;
+  done = 0;
+  while (done < n) {
+    /* the run of consecutive logical blocks starting at done */
+    i = done + 1;
+    while (i < n && db[i].lbn == db[i - 1].lbn + 1) {
+      i++;
+    }
+    goal = fileGoal(ip, db[done].lbn);
+    if (pa != NULL) {
+      /* the window, if there is one, starts at the goal */
+      releasePrealloc(pa);
+    }
+    got = allocRun(goal, i - done, &start);
+    if (got < 0) {
+      res = got;
+      break;
+    }
+    /* indirect blocks go behind the run */
+    goal = start + got;
+    for (i = 0; i < got; i++) {
+      res = bmapSet(ip, db[done + i].lbn, start + i, NULL, &goal);
+      if (res < 0) {
+        break;
+      }
+      assignBlock(db[done + i].buf, start + i);
+    }
+    done += i;
+    if (res < 0) {
+      while (i < got) {
+        freeBlock(start + i++);
+      }
+      break;
+    }
+  }
+  if (pa != NULL && done == n && n != 0 &&
+      (off_t) (db[n - 1].lbn + 1) * BLOCK_SIZE >= ip->i_size) {
+    reserveAfter(pa, goal - 1);
+  }
+  ip->i_numDelayed = n - done;
+  if (ip->i_numDelayed != 0) {
+    memmove(db, db + done, ip->i_numDelayed * sizeof(DelayedBlock));
+    setPromise(ip, delayPromise(ip));
+  }
+  if (writeInode(ip) < 0 && res == 0) {
+    res = -EIO;
+  }
+  if (ip->i_numDelayed == 0) {
+    unlinkDelayed(ip);
+    delayedDone(ip);
+  }
+  return res;
+}
+
+
+int allocAllDelayed(void) {
+  Inode *ip;
+  Inode *next;
+  int res;
+  int r;
+
+  res = 0;
+  for (ip = delayedInodes; ip != NULL; ip = next) {
+    next = ip->i_delayNext;
+    r = allocDelayed(ip);
+    if (r < 0 && res == 0) {
+      res = r;
+    }
+  }
+  return res;
+}
+
+
+/*
+ * Get the buffer for logical block lbn of a file, which has no
+ * disk block. A cleared delayed block is made if there is none.
+ */
+int getDelayed(Inode *ip, EOS32_daddr_t lbn, unsigned char **pp) {
+  DelayedBlock *db;
+  EOS32_daddr_t cost;
+  unsigned char *buf;
+  unsigned int n;
+  int pos;
+  int res;
+
+  pos = findDelayed(ip, lbn);
+  if (pos >= 0) {
+    *pp = ip->i_delayed[pos].buf;
+    return 0;
+  }
+  if (numDelayed >= cacheSize / DIRTY_RATIO ||
+      filsys.s_freeblks < numReserved + numPromised + 3) {
+    /* too much has piled up, or too much may have been promised */
+    allocAllDelayed();
+    pos = findDelayed(ip, lbn);
+  }
+  pos = -1 - pos;
+  db = ip->i_delayed;
+  n = ip->i_numDelayed;
+  cost = 1;
+  if (lbn >= NDADDR &&
+      !(pos > 0 && sameIndir(db[pos - 1].lbn, lbn)) &&
+      !(pos < n && sameIndir(db[pos].lbn, lbn))) {
+    cost++;
+  }
+  if (lbn >= NDADDR + NINDIR &&
+      !(n > 0 && db[n - 1].lbn >= NDADDR + NINDIR)) {
+    cost++;
+  }
+  if (filsys.s_freeblks < numReserved + numPromised + cost) {
+    return -ENOSPC;
+  }
+  if (n == ip->i_maxDelayed) {
+    db = realloc(db, 2 * (n + 8) * sizeof(DelayedBlock));
+    if (db == NULL) {
+      return -ENOMEM;
+    }
+    ip->i_delayed = db;
+    ip->i_maxDelayed = 2 * (n + 8);
+  }
+  res = getAnonBlock(&buf);
+  if (res < 0) {
+    return res;
+  }
+  memmove(db + pos + 1, db + pos, (n - pos) * sizeof(DelayedBlock));
+  db[pos].lbn = lbn;
+  db[pos].buf = buf;
+  ip->i_numDelayed++;
+  setPromise(ip, ip->i_promised + cost);
+  if (n == 0) {
+    ip->i_delayNext = delayedInodes;
+    delayedInodes = ip;
+  }
+  *pp = buf;
+  return 0;
+}
+
+
+/*
+ * Drop the delayed blocks of a file beyond a new, smaller size,
+ * and clear the rest of the one holding the new end of file.
+ */
+void truncDelayed(Inode *ip, EOS32_off_t size) {
+  EOS32_daddr_t first;
+  int pos;
+
+  if (ip->i_numDelayed == 0) {
+    return;
+  }
+  first = ((off_t) size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  while (ip->i_numDelayed > 0 &&
+         ip->i_delayed[ip->i_numDelayed - 1].lbn >= first) {
+    dropAnonBlock(ip->i_delayed[--ip->i_numDelayed].buf);
+  }
+  if (size % BLOCK_SIZE != 0) {
+    pos = findDelayed(ip, size / BLOCK_SIZE);
+    if (pos >= 0) {
+      memset(ip->i_delayed[pos].buf + size % BLOCK_SIZE, 0,
+             BLOCK_SIZE - size % BLOCK_SIZE);
+    }
+  }
+  setPromise(ip, delayPromise(ip));
+  if (ip->i_numDelayed == 0) {
+    unlinkDelayed(ip);
+  }
+}
+
+
+/*
+ * The flusher checks under flushLock whether there is work to
+ * do, and then takes fsLock exclusively to give delayed blocks
+ * disk blocks, to store inodes, and to pick the dirty blocks,
+ * which it writes with fsLock given up again.
+ */
+static void *flusherMain(void *arg) {
+  struct timespec ts;
+  time_t now;
+  int lazy;
+  int res;
+  int r;
+
+  pthread_mutex_lock(&flushLock);
+  while (!flusherStop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += FLUSH_INTERVAL;
+    pthread_cond_timedwait(&flushCond, &flushLock, &ts);
+    now = time(NULL);
+    lazy = numLazyInodes != 0 && now - lazySince >= LAZY_EXPIRE;
+    if (!flushWanted && !lazy &&
+        (numDirty == 0 || now - dirtySince < DIRTY_EXPIRE) &&
+        (numDelayed == 0 || now - delayedSince < DIRTY_EXPIRE) &&
+        (numDirtyInodes == 0 || now - inodesDirtySince < DIRTY_EXPIRE)) {
+      continue;
+    }
+    flushWanted = 0;
+    pthread_mutex_unlock(&flushLock);
+    pthread_rwlock_wrlock(&fsLock);
+    res = allocAllDelayed();
+    r = flushInodes(lazy);
+    if (res == 0) {
+      res = r;
+    }
+    r = writeBack(1);
+    if (res == 0) {
+      res = r;
+    }
+    pthread_mutex_lock(&flushLock);
+    if (res < 0 && flushError == 0) {
+      flushError = res;
+    }
+  }
+  pthread_mutex_unlock(&flushLock);
+  return NULL;
+}
+
+
+void startFlusher(void) {
+  flusherStop = 0;
+  flushWanted = 0;
+  if (pthread_create(&flusherThread, NULL, flusherMain, NULL) != 0) {
+    error("cannot start flusher thread");
+  }
+}
+
+
+void stopFlusher(void) {
+  pthread_mutex_lock(&flushLock);
+  flusherStop = 1;
+  pthread_cond_signal(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+  pthread_join(flusherThread, NULL);
+}
+
+
+/**************************************************************/
+
+/* inode allocation */
+
+
+/*
+ * The super block caches only NICINOD free inode numbers, and
+ * finding more means searching the inode list. Instead, every
+ * inode block gets a bit set of its free inodes, computed the
+ * first time a free inode is looked for in that block. A rotor
+ * stays on the block where the last inode was found, so that an
+ * allocation usually costs a single bit search. The super block's
+ * list is refilled from the bit sets when the file system is
+ * synced or unmounted.
+ */
+
+
+#define SB_NINODE	20	/* offset of s_ninode in super block */
+#define SB_INODE	24	/* offset of s_inode[] in super block */
+
+
+uint64_t *inodeFreeMap;		/* per inode block, free inodes in it */
+unsigned char *inodeMapValid;	/* per inode block, bit set computed */
+EOS32_daddr_t inodeRotor;	/* inode block to search first */
+int inodeListDirty;		/* super block's inode list out of date */
+
+
+/*
+ * Set up the inode bit sets. Their contents is computed later,
+ * starting with the block which holds the inode the super block
+ * would hand out next.
+ */
+void initInodeMap(void) {
+  unsigned char *buf;
+  unsigned int ninode;
+  EOS32_ino_t ino;
+
+  inodeFreeMap = calloc(filsys.s_isize, sizeof(uint64_t));
+  inodeMapValid = calloc(filsys.s_isize, 1);
+  if (inodeFreeMap == NULL || inodeMapValid == NULL) {
+    error("cannot allocate inode map");
+  }
+  inodeRotor = 0;
+  if (getBlock(1, &buf) < 0) {
+    error("cannot read super block");
+  }
+  ninode = get4Bytes(buf + SB_NINODE);
+  if (ninode > 0 && ninode <= NICINOD) {
+    ino = get4Bytes(buf + SB_INODE + 4 * (ninode - 1));
+    if (ino < filsys.s_isize * NIPB) {
+      inodeRotor = ino / NIPB;
+    }
+  }
+  putBlock(buf);
+  inodeListDirty = 0;
+}
+
+
+static int scanInodeBlock(EOS32_daddr_t iblk) {
+  unsigned char *buf;
+  uint64_t free;
+  int res;
+  int i;
+
+  res = getBlock(2 + iblk, &buf);
+  if (res < 0) {
+    return res;
+  }
+  free = 0;
+  for (i = 0; i < NIPB; i++) {
+    if ((get4Bytes(buf + i * INODE_SIZE) & IFMT) == IFFREE &&
+        iblk * NIPB + i != 0) {
+      free |= (uint64_t) 1 << i;
+    }
+  }
+  putBlock(buf);
+  inodeFreeMap[iblk] = free;
+  inodeMapValid[iblk] = 1;
+  return 0;
+}
+
+
+static EOS32_ino_t takeInode(EOS32_daddr_t iblk) {
+  int i;
+
+  i = __builtin_ctzll(inodeFreeMap[iblk]);
+  inodeFreeMap[iblk] &= ~((uint64_t) 1 << i);
+  filsys.s_freeinos--;
+  inodeListDirty = 1;
+  return iblk * NIPB + i;
+}
+
+
+/*
+ * Allocate an inode number, in the inode block of the goal inode
+ * if possible, so that inodes which are used together share their
+ * blocks. Otherwise the search starts at the rotor. The caller
+ * must write the inode with a type other than IFFREE.
+ */
+int allocInode(EOS32_ino_t goal, EOS32_ino_t *inop) {
+  EOS32_daddr_t iblk;
+  EOS32_daddr_t n;
+  int res;
+
+  if (filsys.s_freeinos == 0) {
+    return -ENOSPC;
+  }
+  iblk = goal / NIPB;
+  if (iblk < filsys.s_isize &&
+      (inodeMapValid[iblk] || scanInodeBlock(iblk) == 0) &&
+      inodeFreeMap[iblk] != 0) {
+    *inop = takeInode(iblk);
+    return 0;
+  }
+  for (n = 0; n < filsys.s_isize; n++) {
+    iblk = (inodeRotor + n) % filsys.s_isize;
+    if (!inodeMapValid[iblk]) {
+      res = scanInodeBlock(iblk);
+      if (res < 0) {
+        return res;
+      }
+    }
+    if (inodeFreeMap[iblk] != 0) {
+      inodeRotor = iblk;
+      *inop = takeInode(iblk);
+      return 0;
+    }
+  }
+  return -ENOSPC;
+}
+
+
+/*
+ * Return an inode number, after the inode was written as IFFREE.
+ */
+void freeInode(EOS32_ino_t ino) {
+  if (inodeMapValid[ino / NIPB]) {
+    inodeFreeMap[ino / NIPB] |= (uint64_t) 1 << (ino % NIPB);
+  }
+  filsys.s_freeinos++;
+  inodeListDirty = 1;
+}
+
+
+/*
+ * Refill the super block's list of free inodes from the bit sets,
+ * computing more of them as needed, and store the free inode count.
+ */
+int writeInodeList(void) {
+  unsigned char *buf;
+  unsigned int ninode;
+  EOS32_daddr_t iblk;
+  EOS32_daddr_t n;
+  uint64_t free;
+  int res;
+  int i;
+
+  if (!inodeListDirty) {
+    return 0;
+  }
+  res = getBlock(1, &buf);
+  if (res < 0) {
+    return res;
+  }
+  ninode = 0;
+  for (n = 0; n < filsys.s_isize && ninode < NICINOD; n++) {
+    iblk = (inodeRotor + n) % filsys.s_isize;
+    if (!inodeMapValid[iblk] && scanInodeBlock(iblk) < 0) {
+      continue;
+    }
+    free = inodeFreeMap[iblk];
+    while (free != 0 && ninode < NICINOD) {
+      i = __builtin_ctzll(free);
+      free &= free - 1;
+      /* the list is used from its end */
+      put4Bytes(buf + SB_INODE + 4 * (NICINOD - 1 - ninode),
+                iblk * NIPB + i);
+      ninode++;
+    }
+  }
+  if (ninode < NICINOD) {
+    memmove(buf + SB_INODE, buf + SB_INODE + 4 * (NICINOD - ninode),
+            4 * ninode);
+    memset(buf + SB_INODE + 4 * ninode, 0, 4 * (NICINOD - ninode));
+  }
+  put4Bytes(buf + SB_NINODE, ninode);
+  put4Bytes(buf + 16, filsys.s_freeinos);
+  res = writeBlock(buf);
+  putBlock(buf);
+  if (res == 0) {
+    inodeListDirty = 0;
+  }
+  return res;
+}
+
+
+/*
+ * Allocate an inode near the goal inode and initialize it as an
+ * empty file of the given type and mode, with one link (two for
+ * a directory). It is returned like by getInode().
+ */
+int newInode(unsigned int mode, unsigned int uid, unsigned int gid,
+             EOS32_ino_t goal, Inode **ipp) {
+  Inode in;
+  int res;
+  int i;
+
+  res = allocInode(goal, &in.i_number);
+  if (res < 0) {
+    return res;
+  }
+  in.i_mode = mode;
+  in.i_nlink = (mode & IFMT) == IFDIR ? 2 : 1;
+  in.i_uid = uid;
+  in.i_gid = gid;
+  in.i_ctime = time(NULL);
+  in.i_mtime = in.i_ctime;
+  in.i_atime = in.i_ctime;
+  in.i_size = 0;
+  for (i = 0; i < NADDR; i++) {
+    in.i_addr[i] = 0;
+  }
+  res = storeInode(&in);
+  if (res == 0) {
+    res = getInode(in.i_number, ipp);
+  }
+  if (res < 0) {
+    in.i_mode = IFFREE;
+    storeInode(&in);
+    freeInode(in.i_number);
+  }
+  return res;
+}
+
+
+/*
+ * Release an inode like putInode(). If it has lost its last link
+ * and nobody refers to it any longer, its blocks and the inode
+ * itself are freed.
+ */
+void releaseInode(Inode *ip) {
+  if (ip->i_nlink == 0 && ip->i_count == 1 && ip->i_nlookup == 0) {
+    if ((ip->i_mode & IFMT) == IFCHR || (ip->i_mode & IFMT) == IFBLK) {
+      /* device number, no block */
+      ip->i_addr[0] = 0;
+    }
+    truncDelayed(ip, 0);
+    if (truncInode(ip, 0) < 0) {
+      warning("cannot free blocks of inode %u", ip->i_number);
+    }
+    ip->i_mode = IFFREE;
+    dirtyClear(ip);
+    if (storeInode(ip) < 0) {
+      warning("cannot free inode %u", ip->i_number);
+    } else {
+      freeInode(ip->i_number);
+    }
+  }
+  putInode(ip);
+}
+
+
+/*
+ * Free an inode which forgetInode() found unlinked and unused.
+ */
+void reclaimInode(EOS32_ino_t ino) {
+  Inode *ip;
+
+  if (getInode(ino, &ip) == 0) {
+    releaseInode(ip);
+  }
+}
+
+
+int syncFileSystem(void) {
+  int res;
+
+  res = allocAllDelayed();
+  if (res == 0) {
+    res = flushInodes(1);
+  }
+  if (res == 0) {
+    res = writeFreeList();
+  }
+  if (res == 0) {
+    res = writeInodeList();
+  }
+  return res;
+}
+
+
+/**************************************************************/
+
+/* sequential readahead */
+
+
+typedef struct {
+  off_t nextOff;		/* where a sequential read would start */
+  unsigned int raWindow;	/* blocks read ahead, 0 if random */
+  EOS32_daddr_t raNext;		/* first block not yet read ahead */
+  EOS32_daddr_t raIndir;	/* indirect block read ahead last */
+  int writable;			/* counted in the inode's i_writers */
+  pthread_mutex_t raLock;	/* held while the fields above change */
+} OpenFile;
+
+
+/*
+ * Start fetching a run of disk blocks in the background.
+ */
+static void adviseBlocks(EOS32_daddr_t bno, unsigned int count) {
+  if (diskMap != NULL) {
+    madvise(diskMap + (size_t) bno * BLOCK_SIZE -
+            ((uintptr_t) diskMap % BLOCK_SIZE),
+            ((size_t) count + 1) * BLOCK_SIZE, MADV_WILLNEED);
+  } else {
+    blkAdvise(&disk, bno, count);
+  }
+}
+
+
+/*
+ * Find the indirect block which bmap() would have to read from
+ * the disk in order to map logical block lbn. Returns 0 if the
+ * mapping can be done from the cache or an extent map.
+ */
+static EOS32_daddr_t uncachedIndir(Inode *ip, EOS32_daddr_t lbn) {
+  unsigned char *buf;
+  EOS32_daddr_t bno;
+
+  if (lbn < NDADDR ||
+      __atomic_load_n(&ip->i_extMap, __ATOMIC_ACQUIRE) != NULL) {
+    return 0;
+  }
+  lbn -= NDADDR;
+  if (lbn < NINDIR) {
+    bno = ip->i_addr[SINGLE_INDIR];
+  } else {
+    lbn -= NINDIR;
+    bno = ip->i_addr[DOUBLE_INDIR];
+    if (lbn >= NINDIR * NINDIR || bno == 0) {
+      return 0;
+    }
+    if (!isCached(bno)) {
+      return bno;
+    }
+    if (getBlock(bno, &buf) < 0) {
+      return 0;
+    }
+    bno = get4Bytes(buf + 4 * (lbn / NINDIR));
+    putBlock(buf);
+  }
+  if (bno == 0 || bno >= filsys.s_fsize || isCached(bno)) {
+    return 0;
+  }
+  return bno;
+}
+
+
+/*
+ * Start fetching the logical blocks from lbn up to (but not
+ * including) end in the background, in physically contiguous
+ * runs. Rather than waiting for an indirect block which is not
+ * yet cached, it is fetched in the background as well and the
+ * readahead stops there; the next call picks it up from the
+ * page cache. Returns the first block which was not read ahead.
+ */
+static EOS32_daddr_t readAhead(OpenFile *of, Inode *ip,
+                               EOS32_daddr_t lbn, EOS32_daddr_t end) {
+  EOS32_daddr_t bno;
+  EOS32_daddr_t ind;
+  EOS32_daddr_t runStart;
+  unsigned int runLen;
+
+  runStart = 0;
+  runLen = 0;
+  for (; lbn < end; lbn++) {
+    ind = uncachedIndir(ip, lbn);
+    if (ind != 0 && ind != of->raIndir) {
+      adviseBlocks(ind, 1);
+      of->raIndir = ind;
+      break;
+    }
+    if (bmap(ip, lbn, &bno) < 0) {
+      break;
+    }
+    if (bno == 0 || bno >= filsys.s_fsize) {
+      continue;
+    }
+    if (runLen != 0 && bno == runStart + runLen) {
+      runLen++;
+      continue;
+    }
+    if (runLen != 0) {
+      adviseBlocks(runStart, runLen);
+    }
+    runStart = bno;
+    runLen = 1;
+  }
+  if (runLen != 0) {
+    adviseBlocks(runStart, runLen);
+  }
+  return lbn;
+}
+
+
+/*
+ * Follow the reads of an open file. As long as they continue
+ * where the previous one ended, keep a window of blocks beyond
+ * the current read in flight, doubling its size with every read
+ * up to RA_MAX blocks. Any other read closes the window. Reads
+ * of the same open file which overlap in time are not sequential
+ * anyway; while one of them reads ahead, the others do not.
+ */
+void seqReadAhead(OpenFile *of, Inode *ip, off_t off, size_t size) {
+  EOS32_daddr_t next;
+  EOS32_daddr_t end;
+  EOS32_daddr_t numBlocks;
+
+  if (pthread_mutex_trylock(&of->raLock) != 0) {
+    return;
+  }
+  if (off != of->nextOff) {
+    of->raWindow = 0;
+    of->raNext = 0;
+  } else
+  if (of->raWindow == 0) {
+    of->raWindow = RA_MIN;
+  } else
+  if (of->raWindow < RA_MAX) {
+    of->raWindow *= 2;
+  }
+  of->nextOff = off + size;
+  if (of->raWindow != 0) {
+    next = (off + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    end = next + of->raWindow;
+    numBlocks = (ip->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > numBlocks) {
+      end = numBlocks;
+    }
+    if (of->raNext > next) {
+      next = of->raNext;
+    }
+    if (next < end) {
+      of->raNext = readAhead(of, ip, next, end);
+    }
+  }
+  pthread_mutex_unlock(&of->raLock);
+}
+
+
+/**************************************************************/
+
+/* directory handling */
+
+
+/*
+ * Copy the name of the directory entry at p to name,
+ * which must have room for DIRSIZ + 1 characters.
+ */
+void getDirName(unsigned char *p, char *name) {
+  memcpy(name, p + 4, DIRSIZ);
+  name[DIRSIZ] = '\0';
+}
+
+
+/*
+ * Hash the name of a directory entry, which ends at a null
+ * character or after DIRSIZ characters.
+ */
+static unsigned int hashName(const char *name) {
+  unsigned int h;
+  int i;
+
+  h = 2166136261u;
+  for (i = 0; i < DIRSIZ && name[i] != '\0'; i++) {
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+  }
+  return h;
+}
+
+
+/*
+ * Call func for every block of a directory, with the number of
+ * the block's first entry slot and the number of slots in the
+ * block which lie within the directory. Stops if func returns
+ * non-zero, and returns what func returned then, 0 if the whole
+ * directory was scanned, or a negative error number.
+ */
+static int dirScan(Inode *dp,
+                   int (*func)(void *arg, unsigned int firstSlot,
+                               unsigned char *buf, int numSlots),
+                   void *arg) {
+  unsigned char *buf;
+  EOS32_daddr_t numBlocks;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  unsigned int numSlots;
+  int res;
+
+  numBlocks = ((off_t) dp->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (lbn = 0; lbn < numBlocks; lbn++) {
+    if (lbn % MAX_PREFETCH == 0 && numBlocks > 1) {
+      prefetchFileBlocks(dp, lbn, numBlocks - lbn);
+    }
+    res = bmap(dp, lbn, &bno);
+    if (res < 0) {
+      return res;
+    }
+    if (bno == 0) {
+      continue;
+    }
+    res = getBlock(bno, &buf);
+    if (res < 0) {
+      return res;
+    }
+    numSlots = dp->i_size / DIRENT_SIZE - lbn * NDIRENT;
+    if (numSlots > NDIRENT) {
+      numSlots = NDIRENT;
+    }
+    res = func(arg, lbn * NDIRENT, buf, numSlots);
+    putBlock(buf);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+
+/**************************************************************/
+
+/* directory name index */
+
+
+/*
+ * A directory larger than one block gets an index, built when
+ * a name is first looked up in it (see prepareDir() below). The
+ * index is a hash table from the hash of an entry's name to the
+ * entry's slot; a hit is confirmed by comparing the name in the
+ * (cached) directory block. The indexes of all directories
+ * together are limited to DI_BUDGET table entries. When a new
+ * index does not fit, the indexes of idle directories are
+ * dropped.
+ */
+
+
+static void diInsert(DirIndex *di, unsigned int hash, unsigned int slot) {
+  unsigned int i;
+
+  i = hash & di->mask;
+  while (di->tab[i].slot != DI_EMPTY && di->tab[i].slot != DI_DELETED) {
+    i = (i + 1) & di->mask;
+  }
+  if (di->tab[i].slot == DI_EMPTY) {
+    di->used++;
+  }
+  di->tab[i].hash = hash;
+  di->tab[i].slot = slot;
+}
+
+
+/*
+ * Allocate an empty index with room for the given number of
+ * entries, making room in the budget if necessary.
+ */
+static DirIndex *diAlloc(unsigned int numEntries) {
+  unsigned int size;
+  DirIndex *di;
+
+  size = 64;
+  while (size < 2 * numEntries) {
+    size *= 2;
+  }
+  if (__atomic_load_n(&dirIndexTotal, __ATOMIC_RELAXED) + size >
+      DI_BUDGET) {
+    dropIdleIndexes(size);
+  }
+  if (__atomic_add_fetch(&dirIndexTotal, size, __ATOMIC_RELAXED) >
+      DI_BUDGET) {
+    __atomic_sub_fetch(&dirIndexTotal, size, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  di = malloc(sizeof(DirIndex) + size * sizeof(DirHash));
+  if (di == NULL) {
+    __atomic_sub_fetch(&dirIndexTotal, size, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  di->mask = size - 1;
+  di->used = 0;
+  memset(di->tab, 0xFF, size * sizeof(DirHash));
+  return di;
+}
+
+
+/*
+ * Record a new entry in the index of a directory, if it has
+ * one. Must be called after the directory's size is updated.
+ */
+static void diAdd(Inode *dp, unsigned int hash, unsigned int slot) {
+  DirIndex *di;
+  DirIndex *bigger;
+  unsigned int i;
+
+  di = dp->i_dirIndex;
+  if (di == NULL) {
+    return;
+  }
+  if (4 * (di->used + 1) > 3 * (di->mask + 1)) {
+    /* rehash into a larger table, dropping deleted entries */
+    bigger = diAlloc(di->mask + 1);
+    if (bigger == NULL) {
+      dropDirIndex(dp);
+      return;
+    }
+    for (i = 0; i <= di->mask; i++) {
+      if (di->tab[i].slot != DI_EMPTY && di->tab[i].slot != DI_DELETED) {
+        diInsert(bigger, di->tab[i].hash, di->tab[i].slot);
+      }
+    }
+    dropDirIndex(dp);
+    dp->i_dirIndex = bigger;
+    di = bigger;
+  }
+  diInsert(di, hash, slot);
+  di->size = dp->i_size;
+}
+
+
+/*
+ * Forget an entry in the index of a directory, if it has one.
+ */
+void dirIndexRemove(Inode *dp, const char *name, unsigned int slot) {
+  DirIndex *di;
+  unsigned int i;
+
+  di = dp->i_dirIndex;
+  if (di == NULL) {
+    return;
+  }
+  i = hashName(name) & di->mask;
+  while (di->tab[i].slot != DI_EMPTY) {
+    if (di->tab[i].slot == slot) {
+      di->tab[i].slot = DI_DELETED;
+      return;
+    }
+    i = (i + 1) & di->mask;
+  }
+}
+
+
+static int diLookup(Inode *dp, DirIndex *di, const char *name,
+                    EOS32_ino_t *inop, unsigned int *slotp) {
+  unsigned int hash;
+  unsigned int i;
+  unsigned int slot;
+  unsigned char *buf;
+  unsigned char *p;
+  EOS32_daddr_t bno;
+  EOS32_ino_t ino;
+  int res;
+
+  hash = hashName(name);
+  for (i = hash & di->mask;
+       di->tab[i].slot != DI_EMPTY;
+       i = (i + 1) & di->mask) {
+    slot = di->tab[i].slot;
+    if (slot == DI_DELETED || di->tab[i].hash != hash) {
+      continue;
+    }
+    res = bmap(dp, slot / NDIRENT, &bno);
+    if (res < 0) {
+      return res;
+    }
+    if (bno == 0) {
+      continue;
+    }
+    res = getBlock(bno, &buf);
+    if (res < 0) {
+      return res;
+    }
+    p = buf + (slot % NDIRENT) * DIRENT_SIZE;
+    ino = get4Bytes(p);
+    if (ino != 0 && strncmp((char *) p + 4, name, DIRSIZ) == 0) {
+      putBlock(buf);
+      *inop = ino;
+      *slotp = slot;
+      return 0;
+    }
+    putBlock(buf);
+  }
+  return -ENOENT;
+}
+
+
+/**************************************************************/
+
+/* negative lookup filter */
+
+
+/*
+ * Every directory which has been searched gets a Bloom filter
+ * over the names of its entries, built by the same scan as its
+ * index. Most lookups of names which do not exist are answered
+ * by the filter alone. Removed names stay in the filter, which
+ * only costs an occasional scan.
+ */
+
+
+static DirBloom *bloomAlloc(unsigned int numEntries) {
+  unsigned int size;
+  DirBloom *bf;
+
+  size = 512;
+  while (size < BLOOM_BITS * numEntries) {
+    size *= 2;
+  }
+  bf = calloc(1, sizeof(DirBloom) + size / 8);
+  if (bf == NULL) {
+    return NULL;
+  }
+  bf->mask = size - 1;
+  return bf;
+}
+
+
+static void bloomAdd(DirBloom *bf, unsigned int hash) {
+  unsigned int step;
+  unsigned int bit;
+  int k;
+
+  step = ((hash >> 16) | (hash << 16)) | 1;
+  for (k = 0; k < BLOOM_HASHES; k++) {
+    bit = (hash + k * step) & bf->mask;
+    bf->bits[bit / 32] |= 1u << (bit % 32);
+  }
+  bf->numNames++;
+}
+
+
+static int bloomMayContain(DirBloom *bf, unsigned int hash) {
+  unsigned int step;
+  unsigned int bit;
+  int k;
+
+  step = ((hash >> 16) | (hash << 16)) | 1;
+  for (k = 0; k < BLOOM_HASHES; k++) {
+    bit = (hash + k * step) & bf->mask;
+    if ((bf->bits[bit / 32] & (1u << (bit % 32))) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static int addNames(void *arg, unsigned int firstSlot,
+                    unsigned char *buf, int numSlots) {
+  Inode *dp;
+  unsigned char *p;
+  unsigned int hash;
+  int i;
+
+  dp = arg;
+  for (i = 0; i < numSlots; i++) {
+    p = buf + i * DIRENT_SIZE;
+    if (get4Bytes(p) == 0) {
+      continue;
+    }
+    hash = hashName((char *) p + 4);
+    if (dp->i_dirBloom != NULL) {
+      bloomAdd(dp->i_dirBloom, hash);
+    }
+    if (dp->i_dirIndex != NULL) {
+      diInsert(dp->i_dirIndex, hash, firstSlot + i);
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Check whether a directory has a current name filter and, if
+ * it is larger than one block, a current name index.
+ */
+static int dirPrepared(Inode *dp) {
+  return dp->i_dirBloom != NULL && dp->i_dirBloom->size == dp->i_size &&
+         (dp->i_size <= BLOCK_SIZE ||
+          (dp->i_dirIndex != NULL && dp->i_dirIndex->size == dp->i_size));
+}
+
+
+/*
+ * Make sure that a directory has a current name filter and, if
+ * it is larger than one block, a current name index, building
+ * both with a single scan of the directory. A directory whose
+ * index does not fit into the budget keeps its filter. Must be
+ * called with the directory's lock held exclusively.
+ */
+static void prepareDir(Inode *dp) {
+  int haveBloom;
+  int wantIndex;
+  unsigned int numSlots;
+
+  if (dirPrepared(dp)) {
+    return;
+  }
+  haveBloom = dp->i_dirBloom != NULL && dp->i_dirBloom->size == dp->i_size;
+  wantIndex = dp->i_size > BLOCK_SIZE;
+  numSlots = dp->i_size / DIRENT_SIZE;
+  dropDirIndex(dp);
+  if (wantIndex) {
+    dp->i_dirIndex = diAlloc(numSlots);
+    if (haveBloom && dp->i_dirIndex == NULL) {
+      return;
+    }
+  }
+  free(dp->i_dirBloom);
+  dp->i_dirBloom = bloomAlloc(numSlots);
+  if (dp->i_dirBloom == NULL && dp->i_dirIndex == NULL) {
+    return;
+  }
+  if (dirScan(dp, addNames, dp) < 0) {
+    dropDirIndex(dp);
+    free(dp->i_dirBloom);
+    dp->i_dirBloom = NULL;
+    return;
+  }
+  if (dp->i_dirIndex != NULL) {
+    dp->i_dirIndex->size = dp->i_size;
+  }
+  if (dp->i_dirBloom != NULL) {
+    dp->i_dirBloom->size = dp->i_size;
+  }
+}
+
+
+/*
+ * Record a new entry in the filter and the index of a directory.
+ * Must be called after the directory's size is updated.
+ */
+void dirIndexAdd(Inode *dp, const char *name, unsigned int slot) {
+  DirBloom *bf;
+  unsigned int hash;
+
+  hash = hashName(name);
+  bf = dp->i_dirBloom;
+  if (bf != NULL) {
+    if (bf->numNames >= 2 * (bf->mask + 1) / BLOOM_BITS) {
+      /* too full to be useful, rebuild on next lookup */
+      free(bf);
+      dp->i_dirBloom = NULL;
+    } else {
+      bloomAdd(bf, hash);
+      bf->size = dp->i_size;
+    }
+  }
+  diAdd(dp, hash, slot);
+}
+
+
+/**************************************************************/
+
+/* name lookup */
+
+
+typedef struct {
+  const char *name;		/* name looked for */
+  EOS32_ino_t ino;		/* its inode number, when found */
+  unsigned int slot;		/* and its entry's slot */
+} NameMatch;
+
+
+static int matchName(void *arg, unsigned int firstSlot,
+                     unsigned char *buf, int numSlots) {
+  NameMatch *m;
+  int i;
+
+  m = arg;
+  i = dirScanName(buf, numSlots, m->name);
+  if (i < 0) {
+    return 0;
+  }
+  m->ino = get4Bytes(buf + i * DIRENT_SIZE);
+  m->slot = firstSlot + i;
+  return 1;
+}
+
+
+static int searchDir(Inode *dp, const char *name,
+                     EOS32_ino_t *inop, unsigned int *slotp) {
+  DirIndex *di;
+  NameMatch m;
+  int res;
+
+  if (dp->i_dirBloom != NULL &&
+      !bloomMayContain(dp->i_dirBloom, hashName(name))) {
+    return -ENOENT;
+  }
+  di = dp->i_dirIndex;
+  if (di != NULL) {
+    return diLookup(dp, di, name, inop, slotp);
+  }
+  m.name = name;
+  res = dirScan(dp, matchName, &m);
+  if (res < 0) {
+    return res;
+  }
+  if (res == 0) {
+    return -ENOENT;
+  }
+  *inop = m.ino;
+  *slotp = m.slot;
+  return 0;
+}
+
+
+/*
+ * Find a name in a directory, returning the inode number and
+ * the slot of its entry. Lookups in the same directory proceed
+ * in parallel; only building its filter and index excludes the
+ * others.
+ */
+int dirFind(Inode *dp, const char *name,
+            EOS32_ino_t *inop, unsigned int *slotp) {
+  int res;
+
+  if ((dp->i_mode & IFMT) != IFDIR) {
+    return -ENOTDIR;
+  }
+  if (strlen(name) > DIRSIZ) {
+    return -ENAMETOOLONG;
+  }
+  pthread_rwlock_rdlock(&dp->i_lock);
+  if (!dirPrepared(dp)) {
+    pthread_rwlock_unlock(&dp->i_lock);
+    pthread_rwlock_wrlock(&dp->i_lock);
+    prepareDir(dp);
+    pthread_rwlock_unlock(&dp->i_lock);
+    pthread_rwlock_rdlock(&dp->i_lock);
+  }
+  res = searchDir(dp, name, inop, slotp);
+  pthread_rwlock_unlock(&dp->i_lock);
+  return res;
+}
+
+
+int dirLookup(Inode *dp, const char *name, EOS32_ino_t *inop) {
+  unsigned int slot;
+
+  return dirFind(dp, name, inop, &slot);
+}
+
+
+/**************************************************************/
+
+/* directory modification */
+
+
+static int findFree(void *arg, unsigned int firstSlot,
+                    unsigned char *buf, int numSlots) {
+  int i;
+
+  i = dirScanFree(buf, numSlots);
+  if (i < 0) {
+    return 0;
+  }
+  *(unsigned int *) arg = firstSlot + i;
+  return 1;
+}
+
+
+/*
+ * Set the inode number of the entry in a given slot of a
+ * directory, and its name if name is not NULL.
+ */
+static int dirSetEntry(Inode *dp, unsigned int slot,
+                       const char *name, EOS32_ino_t ino) {
+  unsigned char *buf;
+  unsigned char *p;
+  EOS32_daddr_t bno;
+  int res;
+
+  res = bmapAlloc(dp, slot / NDIRENT, NULL, &bno);
+  if (res < 0) {
+    return res;
+  }
+  if (res == 1) {
+    res = getNewBlock(bno, &buf);
+  } else {
+    res = getBlock(bno, &buf);
+  }
+  if (res < 0) {
+    return res;
+  }
+  p = buf + (slot % NDIRENT) * DIRENT_SIZE;
+  put4Bytes(p, ino);
+  if (name != NULL) {
+    memset(p + 4, 0, DIRSIZ);
+    strncpy((char *) p + 4, name, DIRSIZ);
+  }
+  res = writeBlock(buf);
+  putBlock(buf);
+  if (res < 0) {
+    return res;
+  }
+  dp->i_mtime = time(NULL);
+  dp->i_ctime = dp->i_mtime;
+  return 0;
+}
+
+
+/*
+ * Enter a name into a directory, in its first free slot or at
+ * its end. The caller must write the directory's inode.
+ */
+int dirEnter(Inode *dp, const char *name, EOS32_ino_t ino) {
+  unsigned int slot;
+  int res;
+
+  res = dirScan(dp, findFree, &slot);
+  if (res < 0) {
+    return res;
+  }
+  if (res == 0) {
+    if (dp->i_size > 0xFFFFFFFF - DIRENT_SIZE) {
+      return -EFBIG;
+    }
+    slot = dp->i_size / DIRENT_SIZE;
+  }
+  res = dirSetEntry(dp, slot, name, ino);
+  if (res < 0) {
+    return res;
+  }
+  if ((slot + 1) * DIRENT_SIZE > dp->i_size) {
+    dp->i_size = (slot + 1) * DIRENT_SIZE;
+  }
+  dirIndexAdd(dp, name, slot);
+  return 0;
+}
+
+
+/*
+ * Remove the entry for name, which is in the given slot, from
+ * a directory. The caller must write the directory's inode.
+ */
+int dirRemove(Inode *dp, const char *name, unsigned int slot) {
+  int res;
+
+  res = dirSetEntry(dp, slot, NULL, 0);
+  if (res < 0) {
+    return res;
+  }
+  dirIndexRemove(dp, name, slot);
+  return 0;
+}
+
+
+static int findOther(void *arg, unsigned int firstSlot,
+                     unsigned char *buf, int numSlots) {
+  unsigned char *p;
+  int i;
+
+  for (i = 0; i < numSlots; i++) {
+    p = buf + i * DIRENT_SIZE;
+    if (get4Bytes(p) != 0 &&
+        strncmp((char *) p + 4, ".", DIRSIZ) != 0 &&
+        strncmp((char *) p + 4, "..", DIRSIZ) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Check whether a directory holds nothing but "." and "..".
+ * Returns 1 if so, 0 if not, or a negative error number.
+ */
+int dirIsEmpty(Inode *dp) {
+  int res;
+
+  res = dirScan(dp, findOther, NULL);
+  if (res < 0) {
+    return res;
+  }
+  return res == 0;
+}
+
+
+/**************************************************************/
+
+/* mount options */
+
+
+typedef struct {
+  unsigned int cacheMB;		/* size of block cache in MiB */
+  int useMmap;			/* access file system through mmap */
+  double attrTimeout;		/* seconds the kernel may cache attributes */
+  double entryTimeout;		/* seconds the kernel may cache names */
+  int readOnly;			/* file system is mounted read-only */
+  int atime;			/* ATIME_xxx */
+  int lazyTime;			/* keep changed time stamps in memory */
+} Options;
+
+
+#define ATIME_NO	0	/* never update access times */
+#define ATIME_REL	1	/* update them if older than mtime/ctime */
+#define ATIME_STRICT	2	/* update them on every access */
+
+
+Options options = {
+  DEF_CACHE_MB,
+  0,
+  ATTR_TIMEOUT,
+  ENTRY_TIMEOUT,
+  1,
+  ATIME_REL,
+  0,
+};
+
+
+#define EOS32_OPT(t, p)	{ t, offsetof(Options, p), 1 }
+
+#define KEY_RO		1
+#define KEY_RW		2
+#define KEY_NOATIME	3
+#define KEY_RELATIME	4
+#define KEY_STRICTATIME	5
+#define KEY_LAZYTIME	6
+
+struct fuse_opt eos32Opts[] = {
+  EOS32_OPT("cache_mb=%u", cacheMB),
+  EOS32_OPT("mmap", useMmap),
+  EOS32_OPT("attr_timeout=%lf", attrTimeout),
+  EOS32_OPT("entry_timeout=%lf", entryTimeout),
+  FUSE_OPT_KEY("ro", KEY_RO),
+  FUSE_OPT_KEY("rw", KEY_RW),
+  FUSE_OPT_KEY("noatime", KEY_NOATIME),
+  FUSE_OPT_KEY("relatime", KEY_RELATIME),
+  FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+  FUSE_OPT_KEY("lazytime", KEY_LAZYTIME),
+  FUSE_OPT_END
+};
+
+
+/*
+ * Note a read-write mount, which must be asked for, and the access
+ * time options. The kernel gets to see ro, rw and noatime, the
+ * other ones are not known to the FUSE mount code.
+ */
+int eos32OptProc(void *data, const char *arg, int key,
+                 struct fuse_args *outargs) {
+  switch (key) {
+    case KEY_RO:
+      options.readOnly = 1;
+      return 1;
+    case KEY_RW:
+      options.readOnly = 0;
+      return 1;
+    case KEY_NOATIME:
+      options.atime = ATIME_NO;
+      return 1;
+    case KEY_RELATIME:
+      options.atime = ATIME_REL;
+      return 0;
+    case KEY_STRICTATIME:
+      options.atime = ATIME_STRICT;
+      return 0;
+    case KEY_LAZYTIME:
+      options.lazyTime = 1;
+      return 0;
+  }
+  return 1;
+}
+
+
+/**************************************************************/
+
+/* time stamps */
+
+
+/*
+ * Reading a file or a directory sets its access time: never with
+ * noatime, every time with strictatime, and with relatime (the
+ * default) only if it is not later than the modification or the
+ * change time, or is a day old. So the first read after a change
+ * is still recorded, but reading a file over and over does not
+ * modify its inode each time. With lazytime, changes of the time
+ * stamps alone, by reads and by writes which leave the size as it
+ * is, are kept in the inode cache (see writeTimes()).
+ */
+
+
+#define RELATIME_AGE	(24 * 60 * 60)	/* seconds before atime is old */
+
+
+/*
+ * Store an inode whose time stamps were the only fields changed.
+ */
+int touchInode(Inode *ip) {
+  if (options.lazyTime) {
+    writeTimes(ip);
+    return 0;
+  }
+  return writeInode(ip);
+}
+
+
+/*
+ * Check whether the access time of an inode is to be updated.
+ */
+static int atimeDue(Inode *ip, time_t now) {
+  EOS32_time_t atime;
+
+  atime = __atomic_load_n(&ip->i_atime, __ATOMIC_RELAXED);
+  return (options.atime != ATIME_REL ||
+          atime <= ip->i_mtime || atime <= ip->i_ctime ||
+          now - atime >= RELATIME_AGE) &&
+         atime != now;
+}
+
+
+/*
+ * Set the access time of an inode which was read. Readers of the
+ * same inode may do so at the same time, hence the inode's lock,
+ * which is only taken if there is something to do.
+ */
+void accessInode(Inode *ip) {
+  time_t now;
+
+  if (options.readOnly || options.atime == ATIME_NO) {
+    return;
+  }
+  now = time(NULL);
+  if (!atimeDue(ip, now)) {
+    return;
+  }
+  pthread_rwlock_wrlock(&ip->i_lock);
+  if (atimeDue(ip, now)) {
+    __atomic_store_n(&ip->i_atime, now, __ATOMIC_RELAXED);
+    touchInode(ip);
+  }
+  pthread_rwlock_unlock(&ip->i_lock);
+}
+
+
+/**************************************************************/
+
+/* FUSE low-level operations, node IDs are EOS32 inode numbers */
+
+
+/*
+ * Reply with an entry for an inode, which the kernel then knows
+ * by its node ID. If fi is not NULL, this is the reply to a create.
+ */
+int replyEntry(fuse_req_t req, Inode *ip, struct fuse_file_info *fi) {
+  struct fuse_entry_param e;
+  int res;
+
+  memset(&e, 0, sizeof(e));
+  e.ino = ip->i_number;
+  e.attr_timeout = options.attrTimeout;
+  e.entry_timeout = options.entryTimeout;
+  inodeToStat(ip, &e.attr);
+  addLookups(ip, 1);
+  if (fi == NULL) {
+    res = fuse_reply_entry(req, &e);
+  } else {
+    res = fuse_reply_create(req, &e, fi);
+  }
+  if (res != 0) {
+    /* the kernel did not get the entry, it will not forget it */
+    addLookups(ip, -1);
+  }
+  return res;
+}
+
+
+void eos32Lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  Inode *dp;
+  Inode *ip;
+  EOS32_ino_t ino;
+  struct fuse_entry_param e;
+  int res;
+
+  res = getInode(parent, &dp);
+  if (res < 0) {
+    /* a stale parent, no name to be cached as missing in it */
+    fuse_reply_err(req, -res);
+    return;
+  }
+  res = dirLookup(dp, name, &ino);
+  putInode(dp);
+  if (res == -ENOENT && options.entryTimeout > 0) {
+    /* let the kernel remember that the name does not exist */
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = options.entryTimeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  if (res == 0) {
+    res = getInode(ino, &ip);
+    if (res == -ENOENT) {
+      /* the entry exists, but its inode does not: that is
+         damage, not a name to be cached as missing */
+      res = -EIO;
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  replyEntry(req, ip, NULL);
+  putInode(ip);
+}
+
+
+/*
+ * Forgetting takes fsLock itself: shared while the kernel's
+ * references are dropped, exclusive only if an unlinked inode
+ * must be freed.
+ */
+void forgetRefs(fuse_ino_t ino, uint64_t nlookup) {
+  int reclaim;
+
+  pthread_rwlock_rdlock(&fsLock);
+  reclaim = forgetInode(ino, nlookup);
+  pthread_rwlock_unlock(&fsLock);
+  if (reclaim) {
+    pthread_rwlock_wrlock(&fsLock);
+    reclaimInode(ino);
+    pthread_rwlock_unlock(&fsLock);
+  }
+}
+
+
+void eos32Forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  forgetRefs(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+
+void eos32ForgetMulti(fuse_req_t req, size_t count,
+                      struct fuse_forget_data *forgets) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    forgetRefs(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+
+void eos32Getattr(fuse_req_t req, fuse_ino_t ino,
+                  struct fuse_file_info *fi) {
+  Inode *ip;
+  struct stat st;
+  int res;
+
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  inodeToStat(ip, &st);
+  putInode(ip);
+  fuse_reply_attr(req, &st, options.attrTimeout);
+}
+
+
+void eos32Setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                  int to_set, struct fuse_file_info *fi) {
+  Inode *ip;
+  struct stat st;
+  int res;
+
+  if (options.readOnly) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  /* nothing is changed unless all of it can be */
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    if ((ip->i_mode & IFMT) == IFDIR) {
+      res = -EISDIR;
+    } else
+    if (attr->st_size > 0xFFFFFFFF) {
+      res = -EFBIG;
+    }
+  }
+  if (res < 0) {
+    putInode(ip);
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    truncDelayed(ip, attr->st_size);
+    res = truncInode(ip, attr->st_size);
+    if (res < 0) {
+      /* some blocks may be gone, which the inode must show */
+      if (writeInode(ip) < 0) {
+        warning("cannot write inode %u", ip->i_number);
+      }
+      putInode(ip);
+      fuse_reply_err(req, -res);
+      return;
+    }
+    ip->i_mtime = time(NULL);
+  }
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    ip->i_mode = (ip->i_mode & IFMT) |
+                 (attr->st_mode & (ISUID | ISGID | ISVTX | 0777));
+  }
+  if (to_set & FUSE_SET_ATTR_UID) {
+    ip->i_uid = attr->st_uid;
+  }
+  if (to_set & FUSE_SET_ATTR_GID) {
+    ip->i_gid = attr->st_gid;
+  }
+  if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+    ip->i_atime = time(NULL);
+  } else
+  if (to_set & FUSE_SET_ATTR_ATIME) {
+    ip->i_atime = attr->st_atime;
+  }
+  if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+    ip->i_mtime = time(NULL);
+  } else
+  if (to_set & FUSE_SET_ATTR_MTIME) {
+    ip->i_mtime = attr->st_mtime;
+  }
+  ip->i_ctime = time(NULL);
+  if (writeInode(ip) < 0) {
+    res = -EIO;
+  }
+  inodeToStat(ip, &st);
+  putInode(ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_attr(req, &st, options.attrTimeout);
+  }
+}
+
+
+void eos32Open(fuse_req_t req, fuse_ino_t ino,
+               struct fuse_file_info *fi) {
+  Inode *ip;
+  OpenFile *of;
+  int res;
+
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if ((ip->i_mode & IFMT) == IFDIR) {
+    res = -EISDIR;
+  } else
+  if ((fi->flags & O_ACCMODE) != O_RDONLY && options.readOnly) {
+    res = -EROFS;
+  }
+  of = NULL;
+  if (res == 0) {
+    of = calloc(1, sizeof(OpenFile));
+    if (of == NULL) {
+      res = -ENOMEM;
+    }
+  }
+  if (res < 0) {
+    putInode(ip);
+    fuse_reply_err(req, -res);
+    return;
+  }
+  of->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+  pthread_mutex_init(&of->raLock, NULL);
+  if (of->writable) {
+    ip->i_writers++;
+  }
+  fi->fh = (uintptr_t) of;
+  fi->keep_cache = 1;
+  if (fuse_reply_open(req, fi) != 0) {
+    /* the open was interrupted, there will be no release */
+    if (of->writable) {
+      ip->i_writers--;
+    }
+    pthread_mutex_destroy(&of->raLock);
+    free(of);
+  }
+  putInode(ip);
+}
+
+
+/*
+ * Reply to a read from the mapped image: the reply's iovecs point
+ * into the mapping, physically contiguous blocks sharing one iovec.
+ * A run of holes gets one iovec pointing to zeros.
+ */
+void readMapped(fuse_req_t req, Inode *ip, size_t size, off_t off) {
+  struct iovec *iov;
+  int cnt;
+  size_t done;
+  size_t n;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t count;
+  unsigned char *p;
+  int res;
+
+  iov = malloc((size / BLOCK_SIZE + 2) * sizeof(struct iovec));
+  if (iov == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  cnt = 0;
+  res = 0;
+  for (done = 0; done < size; done += n) {
+    lbn = (off + done) / BLOCK_SIZE;
+    res = bmapRun(ip, lbn, (off + size - 1) / BLOCK_SIZE - lbn + 1,
+                  &bno, &count);
+    if (res < 0) {
+      break;
+    }
+    if (bno == 0) {
+      p = zeroBlocks;
+      if (count > ZERO_BLOCKS) {
+        count = ZERO_BLOCKS;
+      }
+    } else
+    if (bno + count <= filsys.s_fsize) {
+      p = diskMap + (size_t) bno * BLOCK_SIZE;
+    } else {
+      res = -EIO;
+      break;
+    }
+    n = (size_t) count * BLOCK_SIZE - (off + done) % BLOCK_SIZE;
+    if (n > size - done) {
+      n = size - done;
+    }
+    p += (off + done) % BLOCK_SIZE;
+    if (cnt > 0 &&
+        (unsigned char *) iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == p) {
+      iov[cnt - 1].iov_len += n;
+    } else {
+      iov[cnt].iov_base = p;
+      iov[cnt].iov_len = n;
+      cnt++;
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_iov(req, iov, cnt);
+  }
+  free(iov);
+}
+
+
+/*
+ * Reply to a read with buffers that refer to the disk image, so
+ * that FUSE can splice the data from the image to the kernel
+ * without copying it through user space. Physically contiguous
+ * blocks form a single buffer, and so does a run of holes, which
+ * is served from memory. Returns 1 without replying if the range
+ * is too fragmented to be worth it, or if the disk holds an
+ * outdated version of one of its blocks.
+ */
+int readSpliced(fuse_req_t req, Inode *ip, size_t size, off_t off) {
+  struct fuse_bufvec *bufv;
+  struct fuse_buf *last;
+  size_t done;
+  size_t n;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t count;
+  EOS32_daddr_t i;
+  off_t pos;
+  int res;
+
+  bufv = malloc(sizeof(struct fuse_bufvec) +
+                (MAX_SPLICE_BUFS - 1) * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return 0;
+  }
+  bufv->count = 0;
+  bufv->idx = 0;
+  bufv->off = 0;
+  last = NULL;
+  res = 0;
+  for (done = 0; done < size; done += n) {
+    lbn = (off + done) / BLOCK_SIZE;
+    res = bmapRun(ip, lbn, (off + size - 1) / BLOCK_SIZE - lbn + 1,
+                  &bno, &count);
+    if (res < 0) {
+      break;
+    }
+    if (bno == 0) {
+      if (count > ZERO_BLOCKS) {
+        count = ZERO_BLOCKS;
+      }
+    } else
+    if (bno + count > filsys.s_fsize) {
+      res = -EIO;
+      break;
+    }
+    n = (size_t) count * BLOCK_SIZE - (off + done) % BLOCK_SIZE;
+    if (n > size - done) {
+      n = size - done;
+    }
+    for (i = 0; bno != 0 && i < count; i++) {
+      if (isDirty(bno + i)) {
+        free(bufv);
+        return 1;
+      }
+    }
+    pos = blkOffset(&disk, bno) + (off + done) % BLOCK_SIZE;
+    if (bno != 0 && last != NULL && (last->flags & FUSE_BUF_IS_FD) &&
+        last->pos + last->size == pos) {
+      last->size += n;
+      continue;
+    }
+    if (bufv->count == MAX_SPLICE_BUFS) {
+      free(bufv);
+      return 1;
+    }
+    last = &bufv->buf[bufv->count++];
+    last->size = n;
+    if (bno == 0) {
+      /* hole */
+      last->flags = 0;
+      last->mem = zeroBlocks;
+      last->fd = -1;
+      last->pos = 0;
+    } else {
+      last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+      last->mem = NULL;
+      last->fd = disk.fd;
+      last->pos = pos;
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  }
+  free(bufv);
+  return 0;
+}
+
+
+/*
+ * Read the blocks covering the requested range with a single
+ * batch of reads, directly into the reply buffer. Blocks in the
+ * cache are copied from there instead. This is used for ranges
+ * which cannot be spliced.
+ */
+void readBatched(fuse_req_t req, Inode *ip, size_t size, off_t off) {
+  EOS32_daddr_t first;
+  EOS32_daddr_t numBlocks;
+  EOS32_daddr_t i;
+  EOS32_daddr_t k;
+  EOS32_daddr_t bno;
+  EOS32_daddr_t count;
+  unsigned char *buf;
+  BlkReq *reqs;
+  int n;
+  int j;
+  int res;
+
+  first = off / BLOCK_SIZE;
+  numBlocks = (off + size - 1) / BLOCK_SIZE - first + 1;
+  buf = malloc((size_t) numBlocks * BLOCK_SIZE);
+  reqs = malloc(numBlocks * sizeof(BlkReq));
+  if (buf == NULL || reqs == NULL) {
+    free(buf);
+    free(reqs);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  n = 0;
+  res = 0;
+  for (i = 0; i < numBlocks; i += count) {
+    res = bmapRun(ip, first + i, numBlocks - i, &bno, &count);
+    if (res < 0) {
+      break;
+    }
+    if (bno == 0) {
+      /* holes, or data which has no disk block yet */
+      memset(buf + (size_t) i * BLOCK_SIZE, 0, (size_t) count * BLOCK_SIZE);
+      for (k = 0; ip->i_numDelayed != 0 && k < count; k++) {
+        j = findDelayed(ip, first + i + k);
+        if (j >= 0) {
+          memcpy(buf + (size_t) (i + k) * BLOCK_SIZE,
+                 ip->i_delayed[j].buf, BLOCK_SIZE);
+        }
+      }
+      continue;
+    }
+    if (bno + count > filsys.s_fsize) {
+      res = -EIO;
+      break;
+    }
+    for (k = 0; k < count; k++) {
+      if (copyCached(bno + k, buf + (size_t) (i + k) * BLOCK_SIZE)) {
+        continue;
+      }
+      reqs[n].blockNum = bno + k;
+      reqs[n].buf = buf + (size_t) (i + k) * BLOCK_SIZE;
+      n++;
+    }
+  }
+  if (res == 0) {
+    res = blkReadBatch(&disk, reqs, n);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_buf(req, (char *) buf + off % BLOCK_SIZE, size);
+  }
+  free(reqs);
+  free(buf);
+}
+
+
+void eos32Read(fuse_req_t req, fuse_ino_t ino, size_t size,
+               off_t off, struct fuse_file_info *fi) {
+  Inode *ip;
+  int res;
+
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if (off >= ip->i_size) {
+    putInode(ip);
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  if (size > ip->i_size - off) {
+    size = ip->i_size - off;
+  }
+  if (diskMap != NULL) {
+    readMapped(req, ip, size, off);
+  } else
+  if (ip->i_numDelayed != 0 || readSpliced(req, ip, size, off) != 0) {
+    readBatched(req, ip, size, off);
+  }
+  if (fi->fh != 0) {
+    seqReadAhead((OpenFile *) (uintptr_t) fi->fh, ip, off, size);
+  }
+  accessInode(ip);
+  putInode(ip);
+}
+
+
+/*
+ * Write data into a file. Blocks which are overwritten entirely
+ * are not read first. Data for holes and for the part beyond the
+ * end of the file gets disk blocks only later (see "delayed
+ * allocation").
+ */
+void eos32Write(fuse_req_t req, fuse_ino_t ino, const char *data,
+                size_t size, off_t off, struct fuse_file_info *fi) {
+  Inode *ip;
+  EOS32_off_t oldSize;
+  size_t done;
+  size_t n;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  unsigned char *buf;
+  int res;
+
+  if ((off_t) (off + size) > 0xFFFFFFFF) {
+    fuse_reply_err(req, EFBIG);
+    return;
+  }
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  oldSize = ip->i_size;
+  for (done = 0; done < size; done += n) {
+    n = BLOCK_SIZE - (off + done) % BLOCK_SIZE;
+    if (n > size - done) {
+      n = size - done;
+    }
+    lbn = (off + done) / BLOCK_SIZE;
+    res = bmap(ip, lbn, &bno);
+    if (res < 0) {
+      break;
+    }
+    if (bno == 0) {
+      res = getDelayed(ip, lbn, &buf);
+      if (res < 0) {
+        break;
+      }
+      memcpy(buf + (off + done) % BLOCK_SIZE, data + done, n);
+    } else {
+      if (n == BLOCK_SIZE) {
+        res = getNewBlock(bno, &buf);
+      } else {
+        res = getBlock(bno, &buf);
+      }
+      if (res < 0) {
+        break;
+      }
+      memcpy(buf + (off + done) % BLOCK_SIZE, data + done, n);
+      res = writeBlock(buf);
+      putBlock(buf);
+      if (res < 0) {
+        break;
+      }
+    }
+    if (off + done + n > ip->i_size) {
+      ip->i_size = off + done + n;
+    }
+  }
+  if (done > 0) {
+    ip->i_mtime = time(NULL);
+    ip->i_ctime = ip->i_mtime;
+  }
+  if (ip->i_size == oldSize) {
+    /* new blocks are stored with the inode when they are allocated */
+    touchInode(ip);
+  } else
+  if (writeInode(ip) < 0 && res >= 0) {
+    res = -EIO;
+  }
+  putInode(ip);
+  if (done == 0 && res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_write(req, done);
+  }
+}
+
+
+void eos32Release(fuse_req_t req, fuse_ino_t ino,
+                  struct fuse_file_info *fi) {
+  OpenFile *of;
+  Inode *ip;
+
+  of = (OpenFile *) (uintptr_t) fi->fh;
+  if (of != NULL) {
+    if (of->writable && getInode(ino, &ip) == 0) {
+      if (--ip->i_writers == 0) {
+        /* no more appends to make room for */
+        releasePrealloc(&ip->i_prealloc);
+      }
+      putInode(ip);
+    }
+    pthread_mutex_destroy(&of->raLock);
+    free(of);
+  }
+  fuse_reply_err(req, 0);
+}
+
+
+void eos32Fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                struct fuse_file_info *fi) {
+  int res;
+
+  res = 0;
+  if (!options.readOnly) {
+    res = syncFileSystem();
+    if (res == 0) {
+      res = flushCache();
+    }
+  }
+  fuse_reply_err(req, -res);
+}
+
+
+/*
+ * A file is closed: start writing back what was written, but do
+ * not wait for it.
+ */
+void eos32Flush(fuse_req_t req, fuse_ino_t ino,
+                struct fuse_file_info *fi) {
+  if (!options.readOnly) {
+    wakeFlusher();
+  }
+  fuse_reply_err(req, 0);
+}
+
+
+/*
+ * Create a new inode of the given type and mode, and enter it
+ * into a directory. A new directory gets "." and "..".
+ */
+int makeNode(fuse_req_t req, fuse_ino_t parent, const char *name,
+             unsigned int mode, EOS32_daddr_t rdev, Inode **ipp) {
+  const struct fuse_ctx *ctx;
+  Inode *dp;
+  Inode *ip;
+  EOS32_ino_t ino;
+  int res;
+
+  if (options.readOnly) {
+    return -EROFS;
+  }
+  res = getInode(parent, &dp);
+  if (res < 0) {
+    return res;
+  }
+  res = dirLookup(dp, name, &ino);
+  if (res == 0) {
+    res = -EEXIST;
+  } else
+  if (res == -ENOENT) {
+    /* keep the inodes of a directory's entries together */
+    ctx = fuse_req_ctx(req);
+    res = newInode(mode, ctx->uid, ctx->gid,
+                   dp->i_lastChild != 0 ? dp->i_lastChild : dp->i_number,
+                   &ip);
+  }
+  if (res < 0) {
+    putInode(dp);
+    return res;
+  }
+  dp->i_lastChild = ip->i_number;
+  ip->i_allocGoal = dp->i_addr[0];
+  if ((mode & IFMT) == IFDIR) {
+    res = dirEnter(ip, ".", ip->i_number);
+    if (res == 0) {
+      res = dirEnter(ip, "..", dp->i_number);
+    }
+  } else
+  if ((mode & IFMT) == IFCHR || (mode & IFMT) == IFBLK) {
+    ip->i_addr[0] = rdev;
+  }
+  if (res == 0) {
+    res = writeInode(ip);
+  }
+  if (res == 0) {
+    res = dirEnter(dp, name, ip->i_number);
+  }
+  if (res == 0) {
+    if ((mode & IFMT) == IFDIR) {
+      dp->i_nlink++;
+    }
+    res = writeInode(dp);
+  }
+  putInode(dp);
+  if (res < 0) {
+    ip->i_nlink = 0;
+    releaseInode(ip);
+    return res;
+  }
+  *ipp = ip;
+  return 0;
+}
+
+
+void eos32Mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, dev_t rdev) {
+  unsigned int type;
+  Inode *ip;
+  int res;
+
+  switch (mode & S_IFMT) {
+    case S_IFREG:
+      type = IFREG;
+      break;
+    case S_IFCHR:
+      type = IFCHR;
+      break;
+    case S_IFBLK:
+      type = IFBLK;
+      break;
+    default:
+      /* no FIFOs or sockets in EOS32 */
+      fuse_reply_err(req, EPERM);
+      return;
+  }
+  res = makeNode(req, parent, name,
+                 type | (mode & (ISUID | ISGID | ISVTX | 0777)),
+                 (major(rdev) & 0xFFFF) << 16 | (minor(rdev) & 0xFFFF),
+                 &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  replyEntry(req, ip, NULL);
+  putInode(ip);
+}
+
+
+void eos32Mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode) {
+  Inode *ip;
+  int res;
+
+  res = makeNode(req, parent, name,
+                 IFDIR | (mode & (ISUID | ISGID | ISVTX | 0777)), 0, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  replyEntry(req, ip, NULL);
+  putInode(ip);
+}
+
+
+void eos32Create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode, struct fuse_file_info *fi) {
+  OpenFile *of;
+  Inode *ip;
+  int res;
+
+  of = calloc(1, sizeof(OpenFile));
+  if (of == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  res = makeNode(req, parent, name,
+                 IFREG | (mode & (ISUID | ISGID | ISVTX | 0777)), 0, &ip);
+  if (res < 0) {
+    free(of);
+    fuse_reply_err(req, -res);
+    return;
+  }
+  of->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+  pthread_mutex_init(&of->raLock, NULL);
+  if (of->writable) {
+    ip->i_writers++;
+  }
+  fi->fh = (uintptr_t) of;
+  fi->keep_cache = 1;
+  if (replyEntry(req, ip, fi) != 0) {
+    /* the create was interrupted, there will be no release */
+    if (of->writable) {
+      ip->i_writers--;
+    }
+    pthread_mutex_destroy(&of->raLock);
+    free(of);
+  }
+  putInode(ip);
+}
+
+
+/*
+ * Remove a name from a directory and drop the link it was. If the
+ * name refers to a directory, it must be empty.
+ */
+int removeName(fuse_ino_t parent, const char *name, int isDir) {
+  Inode *dp;
+  Inode *ip;
+  EOS32_ino_t ino;
+  unsigned int slot;
+  int res;
+
+  if (options.readOnly) {
+    return -EROFS;
+  }
+  res = getInode(parent, &dp);
+  if (res < 0) {
+    return res;
+  }
+  res = dirFind(dp, name, &ino, &slot);
+  if (res == 0) {
+    res = getInode(ino, &ip);
+  }
+  if (res < 0) {
+    putInode(dp);
+    return res;
+  }
+  if (!isDir && (ip->i_mode & IFMT) == IFDIR) {
+    res = -EISDIR;
+  } else
+  if (isDir && (ip->i_mode & IFMT) != IFDIR) {
+    res = -ENOTDIR;
+  } else
+  if (isDir) {
+    res = dirIsEmpty(ip);
+    res = res < 0 ? res : res == 0 ? -ENOTEMPTY : 0;
+  }
+  if (res == 0) {
+    res = dirRemove(dp, name, slot);
+  }
+  if (res == 0) {
+    if (isDir) {
+      /* the entry and "." go, and ".." does not count any longer */
+      ip->i_nlink = 0;
+      dp->i_nlink--;
+    } else {
+      ip->i_nlink--;
+    }
+    ip->i_ctime = time(NULL);
+    res = writeInode(ip);
+    if (writeInode(dp) < 0 && res == 0) {
+      res = -EIO;
+    }
+  }
+  putInode(dp);
+  releaseInode(ip);
+  return res;
+}
+
+
+void eos32Unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  fuse_reply_err(req, -removeName(parent, name, 0));
+}
+
+
+void eos32Rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (strcmp(name, ".") == 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  if (strcmp(name, "..") == 0) {
+    fuse_reply_err(req, ENOTEMPTY);
+    return;
+  }
+  fuse_reply_err(req, -removeName(parent, name, 1));
+}
+
+
+void eos32Link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+               const char *newname) {
+  Inode *ip;
+  Inode *dp;
+  EOS32_ino_t other;
+  int res;
+
+  if (options.readOnly) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if ((ip->i_mode & IFMT) == IFDIR) {
+    putInode(ip);
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  res = getInode(newparent, &dp);
+  if (res == 0) {
+    res = dirLookup(dp, newname, &other);
+    if (res == 0) {
+      res = -EEXIST;
+    } else
+    if (res == -ENOENT) {
+      res = dirEnter(dp, newname, ip->i_number);
+      if (res == 0) {
+        res = writeInode(dp);
+      }
+    }
+    putInode(dp);
+  }
+  if (res == 0) {
+    ip->i_nlink++;
+    ip->i_ctime = time(NULL);
+    res = writeInode(ip);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    replyEntry(req, ip, NULL);
+  }
+  putInode(ip);
+}
+
+
+/*
+ * Check whether the directory ino is dp or one of its ancestors.
+ * Returns 1 if so, 0 if not, or a negative error number.
+ */
+int isAncestor(EOS32_ino_t ino, Inode *dp) {
+  EOS32_ino_t cur;
+  EOS32_ino_t up;
+  Inode *ip;
+  int res;
+
+  cur = dp->i_number;
+  while (cur != ino && cur != ROOT_INO) {
+    res = getInode(cur, &ip);
+    if (res < 0) {
+      return res;
+    }
+    res = dirLookup(ip, "..", &up);
+    putInode(ip);
+    if (res < 0) {
+      return res;
+    }
+    cur = up;
+  }
+  return cur == ino;
+}
+
+
+/*
+ * Move the entry name in dp to newname in ndp, replacing an
+ * existing entry there. A directory which is moved to another
+ * parent gets its ".." changed.
+ */
+int moveName(Inode *dp, const char *name, Inode *ndp, const char *newname,
+             unsigned int flags) {
+  Inode *ip;
+  Inode *tp;
+  EOS32_ino_t ino;
+  EOS32_ino_t tino;
+  unsigned int slot;
+  unsigned int tslot;
+  int isDir;
+  int res;
+
+  res = dirFind(dp, name, &ino, &slot);
+  if (res < 0) {
+    return res;
+  }
+  res = dirFind(ndp, newname, &tino, &tslot);
+  if (res == 0 && tino == ino) {
+    /* both names are links to the same file */
+    return 0;
+  }
+  if (res == 0 && (flags & RENAME_NOREPLACE)) {
+    return -EEXIST;
+  }
+  if (res < 0 && res != -ENOENT) {
+    return res;
+  }
+  tp = NULL;
+  if (res == 0) {
+    res = getInode(tino, &tp);
+    if (res < 0) {
+      return res;
+    }
+  }
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    if (tp != NULL) {
+      putInode(tp);
+    }
+    return res;
+  }
+  isDir = (ip->i_mode & IFMT) == IFDIR;
+  if (tp != NULL) {
+    if (isDir && (tp->i_mode & IFMT) != IFDIR) {
+      res = -ENOTDIR;
+    } else
+    if (!isDir && (tp->i_mode & IFMT) == IFDIR) {
+      res = -EISDIR;
+    } else
+    if (isDir) {
+      res = dirIsEmpty(tp);
+      res = res < 0 ? res : res == 0 ? -ENOTEMPTY : 0;
+    }
+  }
+  if (res == 0 && isDir && dp != ndp) {
+    /* a directory must not be moved below itself */
+    res = isAncestor(ino, ndp);
+    res = res < 0 ? res : res == 1 ? -EINVAL : 0;
+  }
+  if (res == 0) {
+    if (tp != NULL) {
+      res = dirSetEntry(ndp, tslot, NULL, ino);
+    } else {
+      res = dirEnter(ndp, newname, ino);
+    }
+  }
+  if (res == 0) {
+    res = dirRemove(dp, name, slot);
+  }
+  if (res == 0 && isDir && dp != ndp) {
+    res = dirFind(ip, "..", &tino, &tslot);
+    if (res == 0) {
+      res = dirSetEntry(ip, tslot, NULL, ndp->i_number);
+    }
+    dp->i_nlink--;
+    ndp->i_nlink++;
+  }
+  if (res == 0 && tp != NULL) {
+    if (isDir) {
+      tp->i_nlink = 0;
+      ndp->i_nlink--;
+    } else {
+      tp->i_nlink--;
+    }
+    tp->i_ctime = time(NULL);
+    res = writeInode(tp);
+  }
+  ip->i_ctime = time(NULL);
+  if (writeInode(ip) < 0 || writeInode(dp) < 0 ||
+      (ndp != dp && writeInode(ndp) < 0)) {
+    res = res < 0 ? res : -EIO;
+  }
+  if (tp != NULL) {
+    releaseInode(tp);
+  }
+  putInode(ip);
+  return res;
+}
+
+
+void eos32Rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 fuse_ino_t newparent, const char *newname,
+                 unsigned int flags) {
+  Inode *dp;
+  Inode *ndp;
+  int res;
+
+  if (options.readOnly) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (flags & ~RENAME_NOREPLACE) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  res = getInode(parent, &dp);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  res = getInode(newparent, &ndp);
+  if (res == 0) {
+    res = moveName(dp, name, ndp, newname, flags);
+    putInode(ndp);
+  }
+  putInode(dp);
+  fuse_reply_err(req, -res);
+}
+
+
+void eos32Opendir(fuse_req_t req, fuse_ino_t ino,
+                  struct fuse_file_info *fi) {
+  Inode *ip;
+  unsigned int mode;
+  int res;
+
+  res = getInode(ino, &ip);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  mode = ip->i_mode;
+  putInode(ip);
+  if ((mode & IFMT) != IFDIR) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  fuse_reply_open(req, fi);
+}
+
+
+/*
+ * Bring the inode table blocks holding the inodes named by the
+ * entries from slot first up to (but not including) slot last
+ * of a directory block into the cache, with one batch of reads.
+ * Inodes which are in the inode cache are skipped.
+ */
+void prefetchInodes(unsigned char *dirBlock, int first, int last) {
+  EOS32_daddr_t bnos[MAX_PREFETCH];
+  EOS32_ino_t ino;
+  int n;
+  int i;
+  int j;
+
+  n = 0;
+  for (i = first; i < last && n < MAX_PREFETCH; i++) {
+    ino = get4Bytes(dirBlock + i * DIRENT_SIZE);
+    if (ino == 0 || ino >= filsys.s_isize * NIPB || isInodeCached(ino)) {
+      continue;
+    }
+    for (j = 0; j < n; j++) {
+      if (bnos[j] == itod(ino)) {
+        break;
+      }
+    }
+    if (j == n) {
+      bnos[n++] = itod(ino);
+    }
+  }
+  prefetchBlocks(bnos, n);
+}
+
+
+/*
+ * Add a directory entry with the attributes of its inode to a
+ * readdirplus reply. The kernel gets a reference to the inode,
+ * which is then left in *ipp, unless the name is "." or "..";
+ * those (and entries whose inode cannot be read) are sent
+ * without attributes. Returns what fuse_add_direntry_plus()
+ * returned.
+ */
+size_t addEntryPlus(fuse_req_t req, char *buf, size_t size,
+                    char *name, EOS32_ino_t ino, off_t next,
+                    Inode **ipp) {
+  struct fuse_entry_param e;
+  Inode *ip;
+  size_t len;
+
+  memset(&e, 0, sizeof(e));
+  e.attr.st_ino = ino;
+  ip = NULL;
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    e.attr.st_mode = S_IFDIR;
+  } else
+  if (getInode(ino, &ip) == 0) {
+    e.ino = ino;
+    e.attr_timeout = options.attrTimeout;
+    e.entry_timeout = options.entryTimeout;
+    inodeToStat(ip, &e.attr);
+  }
+  len = fuse_add_direntry_plus(req, buf, size, name, &e, next);
+  if (ip != NULL && len > size) {
+    putInode(ip);
+    ip = NULL;
+  }
+  if (ip != NULL) {
+    addLookups(ip, 1);
+  }
+  *ipp = ip;
+  return len;
+}
+
+
+/*
+ * The directory offset handed to the kernel is the index of
+ * the next directory entry slot, so that a listing can be
+ * resumed without scanning the directory from its start.
+ * Directory blocks are prefetched in batches like in dirScan(),
+ * and for readdirplus the inode table blocks a directory block
+ * refers to as well.
+ */
+void readDir(fuse_req_t req, fuse_ino_t ino, size_t size,
+             off_t off, int plus) {
+  Inode *dp;
+  Inode *ip;
+  Inode **refs;
+  int numRefs;
+  unsigned char *dirBlock;
+  char *buf;
+  size_t pos;
+  size_t len;
+  off_t slot;
+  off_t numSlots;
+  EOS32_daddr_t numBlocks;
+  EOS32_daddr_t lbn;
+  EOS32_daddr_t bno;
+  unsigned char *p;
+  char name[DIRSIZ + 1];
+  struct stat st;
+  int res;
+  int i;
+
+  res = getInode(ino, &dp);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  buf = malloc(size);
+  refs = NULL;
+  if (plus) {
+    /* the references which the kernel gets with the entries */
+    refs = malloc((size / fuse_add_direntry_plus(req, NULL, 0, "",
+                                                 NULL, 0) + 1) *
+                  sizeof(Inode *));
+  }
+  if (buf == NULL || (plus && refs == NULL)) {
+    free(buf);
+    free(refs);
+    putInode(dp);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  pos = 0;
+  numRefs = 0;
+  numSlots = dp->i_size / DIRENT_SIZE;
+  numBlocks = ((off_t) dp->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  dirBlock = NULL;
+  for (slot = off; slot < numSlots; slot++) {
+    if (dirBlock == NULL || slot % NDIRENT == 0) {
+      if (dirBlock != NULL) {
+        putBlock(dirBlock);
+        dirBlock = NULL;
+      }
+      lbn = slot / NDIRENT;
+      if ((slot == off || lbn % MAX_PREFETCH == 0) && numBlocks > 1) {
+        prefetchFileBlocks(dp, lbn, numBlocks - lbn);
+      }
+      res = bmap(dp, lbn, &bno);
+      if (res < 0) {
+        break;
+      }
+      if (bno == 0) {
+        /* hole, skip the rest of this block */
+        slot |= NDIRENT - 1;
+        continue;
+      }
+      res = getBlock(bno, &dirBlock);
+      if (res < 0) {
+        break;
+      }
+      if (plus) {
+        prefetchInodes(dirBlock, slot % NDIRENT,
+                       numSlots - lbn * NDIRENT < NDIRENT ?
+                         numSlots - lbn * NDIRENT : NDIRENT);
+      }
+    }
+    p = dirBlock + (slot % NDIRENT) * DIRENT_SIZE;
+    if (get4Bytes(p) == 0) {
+      /* empty slot */
+      continue;
+    }
+    getDirName(p, name);
+    if (plus) {
+      len = addEntryPlus(req, buf + pos, size - pos,
+                         name, get4Bytes(p), slot + 1, &ip);
+      if (ip != NULL) {
+        refs[numRefs++] = ip;
+      }
+    } else {
+      memset(&st, 0, sizeof(st));
+      st.st_ino = get4Bytes(p);
+      len = fuse_add_direntry(req, buf + pos, size - pos,
+                              name, &st, slot + 1);
+    }
+    if (len > size - pos) {
+      break;
+    }
+    pos += len;
+  }
+  if (dirBlock != NULL) {
+    putBlock(dirBlock);
+  }
+  accessInode(dp);
+  putInode(dp);
+  if (res < 0 && pos == 0) {
+    fuse_reply_err(req, -res);
+    res = -1;
+  } else {
+    res = fuse_reply_buf(req, buf, pos);
+  }
+  for (i = 0; i < numRefs; i++) {
+    if (res != 0) {
+      /* the kernel did not get the entries, it will not forget them */
+      addLookups(refs[i], -1);
+    }
+    putInode(refs[i]);
+  }
+  free(refs);
+  free(buf);
+}
+
+
+void eos32Readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                  off_t off, struct fuse_file_info *fi) {
+  readDir(req, ino, size, off, 0);
+}
+
+
+/*
+ * Like readdir, but every entry comes with the attributes of its
+ * inode, so that listing a directory with ls -l needs no lookup
+ * per name.
+ */
+void eos32Readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t off, struct fuse_file_info *fi) {
+  readDir(req, ino, size, off, 1);
+}
+
+
+void eos32Statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct statvfs st;
+
+  memset(&st, 0, sizeof(st));
+  st.f_bsize = BLOCK_SIZE;
+  st.f_frsize = BLOCK_SIZE;
+  st.f_blocks = filsys.s_fsize;
+  st.f_bfree = filsys.s_freeblks - numPromised;
+  st.f_bavail = filsys.s_freeblks - numPromised;
+  st.f_files = filsys.s_isize * NIPB;
+  st.f_ffree = filsys.s_freeinos;
+  st.f_favail = filsys.s_freeinos;
+  st.f_namemax = DIRSIZ;
+  fuse_reply_statfs(req, &st);
+}
+
+
+/*
+ * Ask the kernel for what it can do which lets it send fewer,
+ * larger, and concurrent requests. Splicing file data into the
+ * kernel is wanted, splicing written data out of it (SPLICE_READ)
+ * is not: without a write_buf operation, libfuse would only copy
+ * it from the pipe into memory once more.
+ */
+void eos32Init(void *userdata, struct fuse_conn_info *conn) {
+  unsigned int caps;
+
+  caps = FUSE_CAP_ASYNC_READ |
+         FUSE_CAP_SPLICE_WRITE |
+         FUSE_CAP_SPLICE_MOVE |
+         FUSE_CAP_PARALLEL_DIROPS |
+         FUSE_CAP_READDIRPLUS |
+         FUSE_CAP_READDIRPLUS_AUTO;
+  if (!options.readOnly) {
+    /* let the kernel collect written data in its page cache */
+    caps |= FUSE_CAP_WRITEBACK_CACHE;
+  }
+  conn->want |= conn->capable & caps;
+  /* max_write is left as libfuse sets it, as large as its buffers
+     (1 MiB); the kernel then sends reads of the same size, since
+     max_read is not limited with a mount option */
+  conn->max_background = MAX_BACKGROUND;
+  conn->congestion_threshold = MAX_BACKGROUND * 3 / 4;
+  /* time stamps are kept in seconds */
+  conn->time_gran = 1000000000;
+}
+
+
+void eos32Destroy(void *userdata) {
+  if (!options.readOnly &&
+      (syncFileSystem() < 0 || flushCache() < 0)) {
+    warning("cannot write back file system");
+  }
+  showInodeStats();
+  if (diskMap == NULL) {
+    showCacheStats();
+  }
+}
+
 
 /**************************************************************/
 
+/* request locking */
 
-void error(char *fmt, ...) {
-  va_list ap;
 
-  va_start(ap, fmt);
-  printf("Error: ");
-  vprintf(fmt, ap);
-  printf("\n");
-  va_end(ap);
-  exit(1);
+/*
+ * Requests are processed by several threads at once. Those which
+ * only look at the file system hold fsLock shared, those which
+ * change it hold fsLock exclusively. What shared requests modify
+ * (the caches, access times, name indexes, extent maps and the
+ * readahead state of open files) has locks of its own; inodes
+ * evicted from the cache are stored with storeEvicted().
+ */
+
+
+void lockedLookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Lookup(req, parent, name);
+  pthread_rwlock_unlock(&fsLock);
 }
 
 
-void warning(char *fmt, ...) {
-  va_list ap;
+void lockedGetattr(fuse_req_t req, fuse_ino_t ino,
+                   struct fuse_file_info *fi) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Getattr(req, ino, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
 
-  va_start(ap, fmt);
-  printf("Warning: ");
-  vprintf(fmt, ap);
-  printf("\n");
-  va_end(ap);
+
+void lockedSetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                   int to_set, struct fuse_file_info *fi) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Setattr(req, ino, attr, to_set, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedMknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode, dev_t rdev) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Mknod(req, parent, name, mode, rdev);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedMkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Mkdir(req, parent, name, mode);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedUnlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Unlink(req, parent, name);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Rmdir(req, parent, name);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedRename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  fuse_ino_t newparent, const char *newname,
+                  unsigned int flags) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Rename(req, parent, name, newparent, newname, flags);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                const char *newname) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Link(req, ino, newparent, newname);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedCreate(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  mode_t mode, struct fuse_file_info *fi) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Create(req, parent, name, mode, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+/*
+ * Opening for writing counts the inode's writers, and may
+ * truncate the file.
+ */
+void lockedOpen(fuse_req_t req, fuse_ino_t ino,
+                struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+    pthread_rwlock_rdlock(&fsLock);
+  } else {
+    pthread_rwlock_wrlock(&fsLock);
+  }
+  eos32Open(req, ino, fi);
+  pthread_rwlock_unlock(&fsLock);
 }
 
 
+void lockedRead(fuse_req_t req, fuse_ino_t ino, size_t size,
+                off_t off, struct fuse_file_info *fi) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Read(req, ino, size, off, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedWrite(fuse_req_t req, fuse_ino_t ino, const char *data,
+                 size_t size, off_t off, struct fuse_file_info *fi) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Write(req, ino, data, size, off, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+/*
+ * Releasing a file opened for writing gives back its
+ * preallocated blocks.
+ */
+void lockedRelease(fuse_req_t req, fuse_ino_t ino,
+                   struct fuse_file_info *fi) {
+  OpenFile *of;
+
+  of = (OpenFile *) (uintptr_t) fi->fh;
+  if (of != NULL && of->writable) {
+    pthread_rwlock_wrlock(&fsLock);
+  } else {
+    pthread_rwlock_rdlock(&fsLock);
+  }
+  eos32Release(req, ino, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedFsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                 struct fuse_file_info *fi) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Fsync(req, ino, datasync, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedOpendir(fuse_req_t req, fuse_ino_t ino,
+                   struct fuse_file_info *fi) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Opendir(req, ino, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedReaddir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                   off_t off, struct fuse_file_info *fi) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Readdir(req, ino, size, off, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedReaddirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t off, struct fuse_file_info *fi) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Readdirplus(req, ino, size, off, fi);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedStatfs(fuse_req_t req, fuse_ino_t ino) {
+  pthread_rwlock_rdlock(&fsLock);
+  eos32Statfs(req, ino);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+void lockedDestroy(void *userdata) {
+  pthread_rwlock_wrlock(&fsLock);
+  eos32Destroy(userdata);
+  pthread_rwlock_unlock(&fsLock);
+}
+
+
+struct fuse_lowlevel_ops eos32Ops = {
+  .init		= eos32Init,
+  .destroy	= lockedDestroy,
+  .lookup	= lockedLookup,
+  .forget	= eos32Forget,
+  .forget_multi	= eos32ForgetMulti,
+  .getattr	= lockedGetattr,
+  .setattr	= lockedSetattr,
+  .mknod	= lockedMknod,
+  .mkdir	= lockedMkdir,
+  .unlink	= lockedUnlink,
+  .rmdir	= lockedRmdir,
+  .rename	= lockedRename,
+  .link		= lockedLink,
+  .create	= lockedCreate,
+  .open		= lockedOpen,
+  .read		= lockedRead,
+  .write	= lockedWrite,
+  .flush	= eos32Flush,
+  .release	= lockedRelease,
+  .fsync	= lockedFsync,
+  .opendir	= lockedOpendir,
+  .readdir	= lockedReaddir,
+  .readdirplus	= lockedReaddirplus,
+  .statfs	= lockedStatfs,
+};
+
+
 /**************************************************************/
 
 
+void readSuperBlock(void) {
+  unsigned char *buf;
+
+  filsys.s_fsize = 2;
+  if (getBlock(1, &buf) < 0) {
+    error("cannot read super block");
+  }
+  filsys.s_magic = get4Bytes(buf + 0);
+  filsys.s_fsize = get4Bytes(buf + 4);
+  filsys.s_isize = get4Bytes(buf + 8);
+  filsys.s_freeblks = get4Bytes(buf + 12);
+  filsys.s_freeinos = get4Bytes(buf + 16);
+  putBlock(buf);
+  if (filsys.s_magic != SUPER_MAGIC) {
+    error("wrong magic number in super block");
+  }
+  if (filsys.s_fsize > fsSize / SPB) {
+    error("file system is larger than its partition");
+  }
+  if (blkOffset(&disk, filsys.s_fsize) > disk.size) {
+    error("disk image ends within the file system");
+  }
+  if (2 + filsys.s_isize >= filsys.s_fsize) {
+    error("inode list does not fit into file system");
+  }
+}
+
+
 void usage(char *myself) {
   printf("Usage:\n"
          "    %s <disk> <part> <mnt> [<opts>]\n"
@@ -54,33 +6839,79 @@ void usage(char *myself) {
          "        <part>  partition number for EOS32 file system\n"
          "                '*' treat whole disk as a single file system\n"
          "        <mnt>   mount point (directory) for EOS32 file system\n"
-         "        <opts>  other mount options (for FUSE)\n",
-         myself);
+         "        <opts>  other mount options (for FUSE), among them\n"
+         "                -s  process requests in a single thread\n"
+         "                -o max_threads=<n>  number of threads\n"
+         "                    processing requests (default 10)\n"
+         "    EOS32 specific options:\n"
+         "        -o rw            mount read-write (default is\n"
+         "                         read-only, -o ro)\n"
+         "        -o cache_mb=<n>  size of block cache in MiB (default %d)\n"
+         "        -o mmap          map the file system into memory\n"
+         "                         instead of using the block cache\n"
+         "                         (implies -o ro)\n"
+         "        -o attr_timeout=<s>  seconds the kernel may cache\n"
+         "                         attributes (default %.1f)\n"
+         "        -o entry_timeout=<s>  seconds the kernel may cache\n"
+         "                         names, also of missing ones\n"
+         "                         (default %.1f)\n"
+         "        -o noatime       do not record access times\n"
+         "        -o relatime      record them once after a change\n"
+         "                         or daily (default)\n"
+         "        -o strictatime   record them on every access\n"
+         "        -o lazytime      keep changed time stamps in memory\n"
+         "                         until the inode is written anyway\n",
+         myself, DEF_CACHE_MB, ATTR_TIMEOUT, ENTRY_TIMEOUT);
   exit(1);
 }
 
 
 int main(int argc, char *argv[]) {
   char *diskName;
-  FILE *disk;
   unsigned int diskSize;
   int partNumber;
   char *endptr;
   GptEntry entry;
-  unsigned int fsStart;
-  unsigned int fsSize;
   unsigned int numBlocks;
+  struct fuse_args args;
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *se;
+  struct fuse_loop_config *config;
+  int i;
+  int res;
 
   if (argc < 4) {
     usage(argv[0]);
   }
+  /* the FUSE command line is the program name, the mount point,
+     and everything following the mount point */
+  args.argc = 0;
+  args.argv = NULL;
+  args.allocated = 0;
+  fuse_opt_add_arg(&args, argv[0]);
+  fuse_opt_add_arg(&args, argv[3]);
+  for (i = 4; i < argc; i++) {
+    fuse_opt_add_arg(&args, argv[i]);
+  }
+  if (fuse_opt_parse(&args, &options, eos32Opts, eos32OptProc) != 0) {
+    usage(argv[0]);
+  }
+  /* the driver checks no permissions itself, the kernel does so
+     against the modes and owners it gets with the attributes */
+  fuse_opt_add_arg(&args, "-odefault_permissions");
+  if (options.useMmap) {
+    /* the mapping is read-only */
+    options.readOnly = 1;
+  }
+  if (options.readOnly) {
+    /* also when the kernel has not been told so by -o ro */
+    fuse_opt_add_arg(&args, "-oro");
+  }
   diskName = argv[1];
-  disk = fopen(diskName, "r+b");
-  if (disk == NULL) {
+  if (blkOpen(&disk, diskName, !options.readOnly) < 0) {
     error("cannot open disk image '%s'", diskName);
   }
-  fseek(disk, 0, SEEK_END);
-  diskSize = ftell(disk) / SECTOR_SIZE;
+  diskSize = disk.size / SECTOR_SIZE;
   /* set fsStart and fsSize */
   if (strcmp(argv[2], "*") == 0) {
     /* whole disk contains one single file system */
@@ -92,7 +6923,7 @@ int main(int argc, char *argv[]) {
     if (*endptr != '\0') {
       error("cannot read partition number '%s'", argv[2]);
     }
-    gptRead(disk, diskSize);
+    gptRead(&disk, diskSize);
     gptGetEntry(partNumber, &entry);
     if (strcmp(entry.type, GPT_NULL_UUID) == 0) {
       error("partition %d is not used", partNumber);
@@ -104,6 +6935,7 @@ int main(int argc, char *argv[]) {
     fsStart = entry.start;
     fsSize = entry.end - entry.start + 1;
   }
+  blkSetStart(&disk, fsStart);
   printf("File system start is at sector %u (0x%X).\n",
          fsStart, fsStart);
   printf("File system space is %u (0x%X) sectors of %d bytes each.\n",
@@ -117,8 +6949,66 @@ int main(int argc, char *argv[]) {
   if (numBlocks < 2) {
     error("file system has less than 2 blocks");
   }
-  printf("------------------------------------\n");
-  printf("This is just a dummy for now, sorry.\n");
-  printf("------------------------------------\n");
-  return 0;
+  if (options.useMmap) {
+    mapDisk();
+  } else {
+    initCache(options.cacheMB);
+  }
+  initInodeCache();
+  readSuperBlock();
+  printf("File system size = %u blocks, %u inodes.\n",
+         filsys.s_fsize, filsys.s_isize * NIPB);
+  if (!options.readOnly) {
+    buildFreeMap();
+    initInodeMap();
+  }
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    usage(argv[0]);
+  }
+  if (opts.show_help) {
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    exit(0);
+  }
+  se = fuse_session_new(&args, &eos32Ops, sizeof(eos32Ops), NULL);
+  if (se == NULL) {
+    error("cannot create FUSE session");
+  }
+  if (fuse_set_signal_handlers(se) != 0) {
+    error("cannot install signal handlers");
+  }
+  if (fuse_session_mount(se, opts.mountpoint) != 0) {
+    error("cannot mount file system on '%s'", opts.mountpoint);
+  }
+  fuse_daemonize(opts.foreground);
+  if (!options.readOnly) {
+    startFlusher();
+  }
+  if (opts.singlethread) {
+    res = fuse_session_loop(se);
+  } else {
+    /* the number of threads is set with -o max_threads */
+    config = fuse_loop_cfg_create();
+    if (config == NULL) {
+      error("cannot create FUSE loop configuration");
+    }
+    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+    fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+    res = fuse_session_loop_mt(se, config);
+    fuse_loop_cfg_destroy(config);
+  }
+  if (!options.readOnly) {
+    stopFlusher();
+  }
+  fuse_session_unmount(se);
+  fuse_remove_signal_handlers(se);
+  fuse_session_destroy(se);
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  if (diskMap != NULL) {
+    unmapDisk();
+  }
+  blkClose(&disk);
+  return res == 0 ? 0 : 1;
 }
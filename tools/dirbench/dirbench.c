@@ -0,0 +1,324 @@
+/*
+ * dirbench.c -- check and time the directory block scanners
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dirscan.h"
+
+
+#define NUM_SLOTS	64		/* entries in a full 4 KiB block */
+#define NUM_TESTS	200000		/* random blocks to check */
+#define DEF_ROUNDS	1000000		/* default timing rounds */
+
+
+static unsigned char blk[NUM_SLOTS * DIRSCAN_ENTRY_SIZE];
+
+
+/**************************************************************/
+
+/* the plain loops which the scanners replace */
+
+
+static int refScanName(unsigned char *blk, int numSlots, const char *name) {
+  unsigned char *p;
+  int i;
+
+  for (i = 0; i < numSlots; i++) {
+    p = blk + i * DIRSCAN_ENTRY_SIZE;
+    if ((p[0] | p[1] | p[2] | p[3]) != 0 &&
+        strncmp((char *) p + DIRSCAN_NAME_OFF, name,
+                DIRSCAN_NAME_SIZE) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+static int refScanFree(unsigned char *blk, int numSlots) {
+  unsigned char *p;
+  int i;
+
+  for (i = 0; i < numSlots; i++) {
+    p = blk + i * DIRSCAN_ENTRY_SIZE;
+    if ((p[0] | p[1] | p[2] | p[3]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+/**************************************************************/
+
+/* test blocks */
+
+
+/*
+ * Names are drawn from a small alphabet with a common prefix or
+ * suffix now and then, so that the parallel compare produces
+ * candidates which only the full compare can reject.
+ */
+static void randomName(char *name, int maxLen) {
+  int len;
+  int i;
+
+  len = 1 + rand() % maxLen;
+  for (i = 0; i < len; i++) {
+    name[i] = "abcx"[rand() % 4];
+  }
+  if (rand() % 4 == 0 && len >= 16) {
+    memcpy(name, "common_prefix___", 16);
+  } else
+  if (rand() % 4 == 0 && len >= 16) {
+    memcpy(name + len - 16, "___common_suffix", 16);
+  }
+  name[len] = '\0';
+}
+
+
+static void setEntry(int slot, unsigned int ino, const char *name) {
+  unsigned char *p;
+
+  p = blk + slot * DIRSCAN_ENTRY_SIZE;
+  p[0] = ino >> 24;
+  p[1] = ino >> 16;
+  p[2] = ino >> 8;
+  p[3] = ino;
+  memset(p + DIRSCAN_NAME_OFF, 0, DIRSCAN_NAME_SIZE);
+  memcpy(p + DIRSCAN_NAME_OFF, name, strnlen(name, DIRSCAN_NAME_SIZE));
+}
+
+
+static void fillRandom(void) {
+  char name[DIRSCAN_NAME_SIZE + 8];
+  int i;
+
+  for (i = 0; i < NUM_SLOTS; i++) {
+    randomName(name, rand() % 2 ? 8 : DIRSCAN_NAME_SIZE);
+    /* inode numbers with only one byte set now and then */
+    setEntry(i, rand() % 8 == 0 ? 0 : 1u << (rand() % 32), name);
+  }
+}
+
+
+static void fillFull(char *format) {
+  char name[DIRSCAN_NAME_SIZE + 1];
+  int i;
+
+  for (i = 0; i < NUM_SLOTS; i++) {
+    sprintf(name, format, i);
+    setEntry(i, i + 1, name);
+  }
+}
+
+
+/**************************************************************/
+
+
+static int check(void) {
+  char name[DIRSCAN_NAME_SIZE + 8];
+  unsigned char *p;
+  int numSlots;
+  int errors;
+  int test;
+  int exp;
+  int got;
+
+  errors = 0;
+  for (test = 0; test < NUM_TESTS; test++) {
+    fillRandom();
+    numSlots = rand() % (NUM_SLOTS + 1);
+    switch (rand() % 3) {
+      case 0:
+        /* the name of some entry, maybe past numSlots */
+        p = blk + (rand() % NUM_SLOTS) * DIRSCAN_ENTRY_SIZE;
+        memcpy(name, p + DIRSCAN_NAME_OFF, DIRSCAN_NAME_SIZE);
+        name[DIRSCAN_NAME_SIZE] = '\0';
+        break;
+      case 1:
+        /* such a name made longer than an entry can hold */
+        p = blk + (rand() % NUM_SLOTS) * DIRSCAN_ENTRY_SIZE;
+        memset(name, 'x', sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        memcpy(name, p + DIRSCAN_NAME_OFF,
+               strnlen((char *) p + DIRSCAN_NAME_OFF, DIRSCAN_NAME_SIZE));
+        break;
+      default:
+        randomName(name, rand() % 2 ? 8 : DIRSCAN_NAME_SIZE + 4);
+        break;
+    }
+    exp = refScanName(blk, numSlots, name);
+    got = dirScanName(blk, numSlots, name);
+    if (got != exp) {
+      printf("dirScanName(%d, \"%s\"): %d, expected %d\n",
+             numSlots, name, got, exp);
+      errors++;
+    }
+    exp = refScanFree(blk, numSlots);
+    got = dirScanFree(blk, numSlots);
+    if (got != exp) {
+      printf("dirScanFree(%d): %d, expected %d\n", numSlots, got, exp);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+
+/*
+ * Look up every name, and a missing one, in full blocks whose
+ * names share a prefix or a suffix, so that the scanners change
+ * the bytes they compare in parallel or fall back to plain C.
+ */
+static int checkFull(void) {
+  static char *formats[4] = {
+    "file%04d",
+    "a_common_prefix_of_16+_bytes_%04d",
+    "%04d_a_common_suffix_of_16+_bytes",
+    "a_common_prefix_%04d_and_a_common_suffix",
+  };
+  char name[DIRSCAN_NAME_SIZE + 1];
+  int numSlots;
+  int errors;
+  int f;
+  int k;
+  int exp;
+  int got;
+
+  errors = 0;
+  for (f = 0; f < 4; f++) {
+    fillFull(formats[f]);
+    for (numSlots = 0; numSlots <= NUM_SLOTS; numSlots++) {
+      for (k = 0; k <= NUM_SLOTS; k++) {
+        sprintf(name, formats[f], k == NUM_SLOTS ? 9999 : k);
+        exp = refScanName(blk, numSlots, name);
+        got = dirScanName(blk, numSlots, name);
+        if (got != exp) {
+          printf("dirScanName(%d, \"%s\"): %d, expected %d\n",
+                 numSlots, name, got, exp);
+          errors++;
+        }
+      }
+    }
+  }
+  return errors;
+}
+
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void report(char *what, double ref, double scan, int rounds) {
+  printf("%-24s  %8.1f ns  %8.1f ns  %5.2fx\n", what,
+         ref * 1e9 / rounds, scan * 1e9 / rounds, ref / scan);
+}
+
+
+static void timeName(char *what, char *name, int rounds) {
+  volatile int sink;
+  double t0, t1, t2;
+  int sum;
+  int i;
+
+  sum = 0;
+  t0 = now();
+  for (i = 0; i < rounds; i++) {
+    sum += refScanName(blk, NUM_SLOTS, name);
+    __asm__ volatile ("" : : "r" (blk) : "memory");
+  }
+  t1 = now();
+  for (i = 0; i < rounds; i++) {
+    sum += dirScanName(blk, NUM_SLOTS, name);
+    __asm__ volatile ("" : : "r" (blk) : "memory");
+  }
+  t2 = now();
+  sink = sum;
+  (void) sink;
+  report(what, t1 - t0, t2 - t1, rounds);
+}
+
+
+static void timeFree(char *what, int rounds) {
+  volatile int sink;
+  double t0, t1, t2;
+  int sum;
+  int i;
+
+  sum = 0;
+  t0 = now();
+  for (i = 0; i < rounds; i++) {
+    sum += refScanFree(blk, NUM_SLOTS);
+    __asm__ volatile ("" : : "r" (blk) : "memory");
+  }
+  t1 = now();
+  for (i = 0; i < rounds; i++) {
+    sum += dirScanFree(blk, NUM_SLOTS);
+    __asm__ volatile ("" : : "r" (blk) : "memory");
+  }
+  t2 = now();
+  sink = sum;
+  (void) sink;
+  report(what, t1 - t0, t2 - t1, rounds);
+}
+
+
+/*
+ * Time both versions on full blocks, where always the whole
+ * block is scanned. The names in the third block all agree in
+ * their first 16 bytes. Those in the last block agree in their
+ * last 16 bytes, which is the worst case for the parallel
+ * compare: every entry is a candidate, until the scan falls
+ * back to plain C.
+ */
+static void timeScans(int rounds) {
+  printf("%-24s  %11s  %11s  %6s\n", "per block", "strncmp", "dirscan", "");
+  fillFull("%04d_file.c");
+  timeName("name in last slot", "0063_file.c", rounds);
+  timeName("name missing", "9999_file.c", rounds);
+  timeFree("no free slot", rounds);
+  fillFull("file%04d");
+  timeName("short names, missing", "file9999", rounds);
+  fillFull("a_common_prefix_of_16+_bytes_%04d");
+  timeName("common prefix, missing", "a_common_prefix_of_16+_bytes_9999",
+           rounds);
+  fillFull("%04d_a_common_suffix_of_16+_bytes");
+  timeName("common suffix, missing", "9999_a_common_suffix_of_16+_bytes",
+           rounds);
+}
+
+
+int main(int argc, char *argv[]) {
+  int rounds;
+  int errors;
+
+  if (argc > 2) {
+    printf("usage: %s [<rounds>]\n", argv[0]);
+    return 1;
+  }
+  rounds = argc == 2 ? atoi(argv[1]) : DEF_ROUNDS;
+  if (rounds <= 0) {
+    printf("error: illegal number of rounds '%s'\n", argv[1]);
+    return 1;
+  }
+  srand(12345);
+  errors = check() + checkFull();
+  if (errors != 0) {
+    printf("%d mismatches\n", errors);
+    return 1;
+  }
+  printf("%d random and some full blocks checked, no mismatches\n",
+         NUM_TESTS);
+  timeScans(rounds);
+  return 0;
+}